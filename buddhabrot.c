@@ -1,14 +1,167 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <complex.h>
 #include <math.h>
+#include <float.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <zlib.h>
 #include "tiffio.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#define BUDDHA_X86 1
+#include <immintrin.h>
+#endif
+
 
+// Defaults for options that can be changed on the command line or in a 
+// config file. 
 #define ITERATIONS 40000
 #define SCALE 4
 #define WIDTH 1440 * SCALE
 #define HEIGHT 900 * SCALE
+#define OUTPUT "buddhabrot.tiff"
+#define CENTER_RE -0.5
+#define CENTER_IM 0.0
+#define SPAN 3.0
+#define ASPECT (2.0 / 3.0)
+#define SEED 1
+
+
+// Ways of choosing the points c to iterate. The grid takes one point per 
+// pixel of the image. The others take any number of points from the 
+// sample region: uniformly at random, one in each cell of a grid laid 
+// over it (jittered), along a Markov chain (Metropolis), from one of 
+// the low-discrepancy Sobol and R2 sequences, or at random but more 
+// densely near the boundary of the set (band). 
+#define SAMPLER_GRID 0
+#define SAMPLER_RANDOM 1
+#define SAMPLER_JITTER 2
+#define SAMPLER_METROPOLIS 3
+#define SAMPLER_SOBOL 4
+#define SAMPLER_R2 5
+#define SAMPLER_BAND 6
+
+const char* sampler_names[] = { 
+    "grid", "random", "jitter", "metropolis", "sobol", "r2", "band", NULL 
+};
+
+// The number of samples in each work unit handed to a thread. 
+#define SAMPLE_UNIT 4096
+
+// Settings for the Metropolis sampler: the steps taken by each chain 
+// (plus those thrown away while it settles), the share of steps that jump 
+// to a new point anywhere in the region rather than nearby, and the 
+// smallest and largest nearby steps as fractions of the view's width. 
+#define MH_CHAIN 16384
+#define MH_BURN_IN 1024
+#define MH_LARGE_STEP 0.2
+#define MH_STEP_MIN 1e-4
+#define MH_STEP_MAX 0.1
+
+// Subdivision of the escapes map works on tiles of SUBDIVIDE_TILE pixels 
+// square, splitting them down to SUBDIVIDE_MIN pixels. While it runs, 
+// pixels of the map not computed yet hold ESCAPE_UNKNOWN, and those filled 
+// in without iterating hold ESCAPE_FILLED. 
+#define SUBDIVIDE_TILE 64
+#define SUBDIVIDE_MIN 8
+
+// The largest tolerance allowed for cycle detection. Any positive 
+// tolerance can take a point that escapes for one in a cycle, so it is 
+// only used when asked for, and kept small. 
+#define CYCLE_TOLERANCE_MAX 1e-6
+#define ESCAPE_FILLED -2
+#define ESCAPE_UNKNOWN -1
+
+// Ways of storing the escapes map: the escape time of each point in 16 or 
+// 32 bits, or just whether it escapes, one bit per point. 
+#define ESCAPE_BITS 1
+#define ESCAPE_16 16
+#define ESCAPE_32 32
+
+// The longest escape time a 16-bit escapes map can hold, leaving room for 
+// ESCAPE_FILLED and ESCAPE_UNKNOWN. 
+#define ESCAPE_16_MAX 0xfffd
+
+// The plot pass is cut into this many work units per thread, of about 
+// equal cost going by the escapes map. 
+#define PLOT_UNITS_PER_THREAD 32
+
+// The width in characters of the timelines printed for each pass. 
+#define TIMELINE_WIDTH 60
+
+// Each parallel pass is cut into up to this many tasks per thread. 
+#define TASKS_PER_THREAD 16
+
+// Ways of pinning the threads of the pool to CPUs. 
+#define PIN_NONE 0
+#define PIN_COMPACT 1
+#define PIN_SPREAD 2
+
+const char* pin_names[] = { "none", "compact", "spread", NULL };
+
+// The output TIFF is compressed in strips of this many rows, in parallel. 
+// If the strips come to more than TIFF_BIG_SIZE bytes, the image is written
+// as a BigTIFF, since offsets in a classic TIFF are 32 bits. 
+#define TIFF_STRIP_ROWS 64
+#define TIFF_BIG_SIZE 0xf0000000ULL
+
+// The passes over the pixels of the image take them in tiles of up to 
+// TILE_WIDTH by TILE_HEIGHT, small enough for a tile's worth of each array 
+// a pass touches to stay in cache. 
+#define TILE_WIDTH 1024
+#define TILE_HEIGHT 16
+
+// With binned plotting, the histogram is split into bins of 
+// 1 << BIN_SHIFT counters, and each thread holds up to BIN_SIZE pending 
+// increments for each bin before adding them in. 
+#define BIN_SHIFT 14
+#define BIN_SIZE 128
+
+// The number of work units of SAMPLE_UNIT points in the pilot run that 
+// finds the hot bins of the histogram for a hybrid histogram. 
+#define HOT_PILOT_UNITS 16
+
+// Layouts of the plot histogram in memory: row-major, or in tiles of 
+// 1 << PLOT_TILE_SHIFT pixels square, stored one after another in 
+// row-major order, with the pixels of each tile in row-major or Morton 
+// (Z) order. 
+#define LAYOUT_ROWS 0
+#define LAYOUT_TILED 1
+#define LAYOUT_MORTON 2
+#define PLOT_TILE_SHIFT 6
+
+const char* layout_names[] = { "rows", "tiled", "morton", NULL };
+
+// Passes over all of the plot's counters, whatever the layout, take them 
+// in chunks of this many. 
+#define PLOT_CHUNK (TILE_WIDTH * TILE_HEIGHT)
+
+// In a compact histogram each counter is 16 bits, and sticks at 
+// COMPACT_MAX, with the rest of its count kept in a spill table. 
+#define COMPACT_MAX 0xffff
+
+// Marks an empty slot in a spill table. 
+#define SPILL_EMPTY ((size_t)-1)
+
+// The most entries in the table of how often each count appears. Larger 
+// counts are grouped by shifting them right until the max fits. 
+#define FREQUENCY_MAX (1 << 24)
+
+// Settings for the band sampler: the number of cells across its map of the
+// sample region, and the escape time that puts a cell in the band even if 
+// all of its corners escape. 
+#define BAND_GRID 256
+#define BAND_MIN_ITS 16
 
 
 #define RED(x) ((x & 0x00ff0000) >> 16)
@@ -16,76 +169,684 @@
 #define BLUE(x) (x & 0x000000ff)
 
 
+// The most points handed to a kernel at once. 
+#define QUEUE_SIZE 8192
+
+
+/**
+ * Counts how busy the lanes of a vector kernel were. slots is the number 
+ * of lane-iterations the kernel paid for, and busy the number that were 
+ * spent iterating a point. 
+ */
+typedef struct _buddha_lanes {
+    long long slots;
+    long long busy;
+} buddha_lanes;
+
+
+/**
+ * The spill table of a compact histogram: a hash table, with open 
+ * addressing, from the offsets of counters that have reached COMPACT_MAX 
+ * to how far past it they are. Only the shared plot's table is added to 
+ * by more than one thread, and the lock is taken for that. 
+ */
+typedef struct _buddha_spill {
+    size_t* keys;
+    long long* values;
+    int size, used;
+    pthread_mutex_t lock;
+} buddha_spill;
+
+
+/**
+ * Per-thread state for a rendering run. In the plot pass each thread 
+ * counts into its own histogram so that no locking is needed, and these 
+ * are summed into the main plot when the pass is done. 
+ */
+typedef struct _buddha_local {
+    int* plot;
+
+    // With wide counters the thread's histogram is held in plot64 instead,
+    // and in compact mode in cells and spill. 
+    long long* plot64;
+    unsigned short* cells;
+    buddha_spill* spill;
+
+    // Set when one of this thread's int counters overflows. Each sum is 
+    // ORed in, so the top bit is set once any goes past INT_MAX. 
+    unsigned int overflow;
+
+    // With binned plotting, the increments waiting to be added to each bin
+    // of the histogram, as offsets within the bin, and how many there are.
+    unsigned short* bins;
+    int* bin_fill;
+
+    // With a hybrid histogram, this thread's copies of the hot bins, one 
+    // after another in the order of their slots, and the hits on each bin 
+    // in the pilot run. With wide counters the copies are in hot64. 
+    int* hot;
+    long long* hot64;
+    long long* hot_hits;
+
+    // Orbit buffers, orbit_len points for each kernel lane, holding the 
+    // orbits of the points being iterated in the plot pass. 
+    double* orbit_re;
+    double* orbit_im;
+    int orbit_len;
+
+    // The points waiting to go through the kernel, and their results. 
+    double* queue_cr;
+    double* queue_ci;
+    int* queue_its;
+    size_t* queue_offs;
+
+    buddha_lanes lanes;
+
+    // Points that were skipped by buddha_reject, counted by the shape 
+    // that contained them. 
+    long long rejected[3];
+
+    // Points found to be in a cycle by the kernel, and the iterations 
+    // that saved. 
+    long long cycles;
+    long long cycles_saved;
+
+    // Set while plotting points whose conjugates were left out of the 
+    // queue, so that each orbit is also counted as its mirror image. 
+    int mirror;
+
+    // The amount added to the histogram for each point plotted. This is 
+    // 1 except for samples that stand for more than one. 
+    int weight;
+
+    // Proposals made and accepted by this thread's Metropolis chains. 
+    long long proposed, accepted;
+
+    // Pixels of the escapes map filled in by subdivision, and those found 
+    // to be wrong when checked. 
+    long long filled, fill_errors;
+
+    // The longest escape time this thread has put in the escapes map. 
+    int longest;
+
+    // How often each count appears in this thread's share of the plot, 
+    // and the number and sum of the nonzero counts there. 
+    long long* frequency;
+    long long nonzero;
+    long long sum;
+
+    // The maximal value seen by this thread while summing the histograms. 
+    long long max;
+} buddha_local;
+
+
+/**
+ * An escape-time kernel. Iterates each of the n points cr[i] + ci[i]*I 
+ * exactly as iterate() would. In the escape pass, the number of 
+ * iterations for each point is stored in its[i]. In the plot pass its is 
+ * NULL, and the orbits of the points that escape are counted into the 
+ * thread's histogram instead. 
+ */
+struct _bb;
+typedef void (*buddha_kernel)(struct _bb* b, buddha_local* l, 
+                              const double* cr, const double* ci, int n, 
+                              int* its);
+
+
 /**
  * Struct that maintains context for the plot during a rendering run. 
  */
 typedef struct _bb {
-    // Map of points that escape (ie those not in the Mandelbrot set). 
-    char* escapes;
+    // Map of points that escape (ie those not in the Mandelbrot set), 
+    // holding the iteration at which each escapes, or 0 for those that 
+    // don't. This is stored as escape_width bits per point; in the 
+    // one-bit form it only tells whether the point escapes. Use 
+    // buddha_escape and buddha_set_escape to get at it. 
+    void* escapes;
+    int escape_width;
+    int longest_escape;
+
+    // Only orbits of points escaping at an iteration from min_orbit to 
+    // max_orbit are plotted. 
+    int min_orbit, max_orbit;
 
     // Each element here is a counter, incremented when a point that escapes
     // assumes its value during iteration. 
     int* plot;
 
+    // Whether the plot has 64-bit counters, held in plot64 rather than in 
+    // plot, or is compact, held in cells and spill. Reads of any of them go
+    // through buddha_count. 
+    int wide;
+    long long* plot64;
+    int compact;
+    unsigned short* cells;
+    buddha_spill spill;
+
     // The final raster image (RGB). 
     char* im;
 
     // The maximal value in the plot array. 
-    int max;
+    long long max;
 
     // Contains an entry for each count up to max, and stores the number of 
     // times that count appears. This information is important in choosing 
-    // color ranges. 
+    // color ranges. Counts are shifted right by frequency_shift first, 
+    // which is only nonzero when the max is too large for a table with an 
+    // entry for every count. 
     // 
     // (The max increases with iterations, but it tends to stay under a few 
     // thousand even up to high numbers.)
-    int* count_frequency; 
+    long long* count_frequency; 
+    int frequency_shift;
 
     // The number of points in the image that escaped. 
-    int num_escaped;
+    long long num_escaped;
 
     // Divides the count space into percentiles. 10% of counts are below 
     // percentile_limit[0], 20% of counts are below percentile_limit[1], 
     // and so on. 
-    int percentile_limit[10];
+    long long percentile_limit[10];
     
     // The mean value in the plot array, for values not in the mandelbrot set.  
-    int mean;
+    long long mean;
 
     int width;
     int height;
     int iterations;
-    int max_offs;
+    size_t max_offs;
     int nebula;
+
+    // The layout of the plot and the per-thread histograms, the number of 
+    // tiles across it in a tiled layout, and the number of counters in 
+    // it, which includes the padding out to whole tiles. 
+    int layout;
+    int plot_tiles_across;
+    size_t plot_size;
+
+    // Number of worker threads used by the parallel passes. 
+    int threads;
+
+    // One entry per thread, allocated for the duration of a run. 
+    buddha_local* locals;
+
+    // Whether to print how busy each thread was over each pass. 
+    int timeline;
+
+    // The threads that run the parallel passes, started by the first one, 
+    // and how they are pinned to CPUs. 
+    struct _buddha_pool* pool;
+    int pin;
+
+    // The compressed strips of the output TIFF. 
+    unsigned char** strips;
+    unsigned long* strip_sizes;
+
+    // The work units of the plot pass: unit u covers the pixels from 
+    // plot_cuts[u] up to plot_cuts[u + 1]. 
+    size_t* plot_cuts;
+    int plot_units;
+
+    // In single-pass mode each orbit is recorded as it is iterated and 
+    // replayed into the plot only if it escapes, instead of iterating every
+    // escaping point twice. No escapes map is needed. 
+    int single_pass;
+
+    // Whether orbit points are collected in bins by where they land in the
+    // histogram and added a bin at a time, so that the counters being 
+    // incremented are in cache, and the number of bins. 
+    int binned;
+    int num_bins;
+
+    // With a hybrid histogram, the number of hot bins each thread keeps a 
+    // private copy of, and for each bin its slot among those, or -1 if it
+    // is counted straight into the shared plot. hot_list holds the bin in 
+    // each of the num_hot slots in use. 
+    int hot_bins;
+    int* hot_slots;
+    int* hot_list;
+    int num_hot;
+
+    // Whether the escapes map is computed by Mariani-Silver subdivision, 
+    // and whether the pixels it fills in are then checked by iterating 
+    // them anyway, and how many were filled and how many of those wrongly.
+    // subdivide_y0 is the first row subdivided. 
+    int subdivide;
+    int verify_fill;
+    int subdivide_y0;
+    long long filled, fill_errors;
+
+    // The escape-time kernel used by the escape pass, picked at startup 
+    // for the CPU we're running on. 
+    buddha_kernel kernel;
+    const char* kernel_name;
+    int lanes;
+
+    // How well the kernel kept its lanes busy in each pass. 
+    buddha_lanes escape_lanes;
+    buddha_lanes plot_lanes;
+
+    // Whether points in the main cardioid and period-2 bulb are skipped 
+    // without iterating, and whether the table of smaller bulbs is also 
+    // checked. 
+    int reject;
+    int bulb_table;
+    long long rejected[3];
+
+    // Whether the kernels look for orbits that have settled into a cycle, 
+    // and how close two values of z must be to count as a repeat. 
+    int cycles;
+    double cycle_tolerance;
+    long long cycles_found;
+    long long cycles_saved;
+
+    // The most points an orbit buffer may hold. Orbits longer than this 
+    // are iterated a second time, as in the two-pass mode. 
+    int orbit_limit;
+
+    // The orbit of conj(c) is the mirror image of the orbit of c, so when 
+    // the rows of the image are symmetric about the real axis only half 
+    // of them need to be iterated. 
+    int symmetric;
+
+    // The region of the complex plane shown in the image. These are 
+    // computed by buddha_set_viewport from its center, its span along the 
+    // real axis, and the ratio of its height to its width. 
+    double re_min, re_max, im_min, im_max;
+    double center_im;
+
+    // Scale factors for px2cx (the size of a pixel, and half its height) 
+    // and for cx2px (pixels per unit). 
+    double px_re, half_px_im;
+    double re_scale, im_scale;
+
+    // How points are sampled, and for the samplers other than the grid, 
+    // how many are taken from which region. In symmetric mode only the 
+    // upper half of a symmetric region is sampled, and sample_im0 is 0. 
+    int sampler;
+    long long samples;
+    double region[4];
+    double sample_im0;
+    int sample_mirror;
+    unsigned long long seed;
+
+    // For the jittered sampler, the number of cells across and down. 
+    long long strata_x, strata_y;
+
+    // For the Sobol and R2 samplers, whether each work unit's points are 
+    // shifted by a random offset (a Cranley-Patterson rotation). 
+    int rotate;
+
+    // For the band sampler, how much more densely the band is sampled 
+    // and how far it is widened, and the map built by buddha_build_band. 
+    int band_boost, band_dilate;
+    int band_gx, band_gy;
+    int* band_its;
+    int* band_cells;
+    int band_count;
+    double band_p;
+
+    // For the Metropolis sampler, the mean number of points that land in 
+    // the view for the orbits that reach it at all, over a uniform pilot 
+    // run, and the starting points for the chains found by it (two doubles
+    // each). Also the proposals made and accepted by the chains, and the 
+    // pilot's sum of weights and count of orbits reaching the view for 
+    // each of its work units. 
+    double mh_mean;
+    double* mh_starts;
+    int mh_num_starts;
+    long long mh_proposed, mh_accepted;
+    double* mh_sums;
 } buddha;
 
 
+void err(int code, char* msg) {
+    fprintf(stderr, msg);
+    fprintf(stderr, "\n");
+    exit(code);
+}
+
+
+void buddha_spill_init(buddha_spill* s) {
+    s->keys = NULL;
+    s->values = NULL;
+    s->size = s->used = 0;
+    pthread_mutex_init(&s->lock, NULL);
+}
+
+
+void buddha_spill_free(buddha_spill* s) {
+    free(s->keys);
+    free(s->values);
+    pthread_mutex_destroy(&s->lock);
+}
+
+
+/**
+ * Returns the slot in the spill table for the counter at offset i: the 
+ * one holding it, or the empty one where it would go. 
+ */
+static inline int buddha_spill_slot(buddha_spill* s, size_t i) {
+    unsigned long long h = (unsigned long long)i * 0x9E3779B97F4A7C15ULL;
+    int mask = s->size - 1, k = (int)(h >> 32) & mask;
+    while(s->keys[k] != SPILL_EMPTY && s->keys[k] != i) {
+        k = (k + 1) & mask;
+    }
+    return k;
+}
+
+
+/**
+ * Returns how far the counter at offset i is past COMPACT_MAX, or 0 if it 
+ * isn't in the table. 
+ */
+long long buddha_spill_get(buddha_spill* s, size_t i) {
+    long long v = 0;
+    pthread_mutex_lock(&s->lock);
+    if(s->size > 0) {
+        int k = buddha_spill_slot(s, i);
+        v = s->keys[k] == i ? s->values[k] : 0;
+    }
+    pthread_mutex_unlock(&s->lock);
+    return v;
+}
+
+
+/**
+ * Adds v to the spilled count of the counter at offset i, doubling the 
+ * table when it gets half full. 
+ */
+void buddha_spill_add(buddha_spill* s, size_t i, long long v) {
+    int k;
+    pthread_mutex_lock(&s->lock);
+    if(2 * (s->used + 1) > s->size) {
+        size_t* keys = s->keys;
+        long long* values = s->values;
+        int old = s->size;
+        s->size = old ? old * 2 : 256;
+        s->keys = (size_t*)malloc(sizeof(size_t) * s->size);
+        s->values = (long long*)malloc(sizeof(long long) * s->size);
+        if(s->keys == NULL || s->values == NULL) {
+            err(5, "Could not allocate the spill table.");
+        }
+        memset(s->keys, 0xff, sizeof(size_t) * s->size);
+        for(k = 0; k < old; k++) {
+            if(keys[k] != SPILL_EMPTY) {
+                int j = buddha_spill_slot(s, keys[k]);
+                s->keys[j] = keys[k];
+                s->values[j] = values[k];
+            }
+        }
+        free(keys);
+        free(values);
+    }
+    k = buddha_spill_slot(s, i);
+    if(s->keys[k] == SPILL_EMPTY) {
+        s->keys[k] = i;
+        s->values[k] = 0;
+        s->used++;
+    }
+    s->values[k] += v;
+    pthread_mutex_unlock(&s->lock);
+}
+
+
+/**
+ * Adds w to the 16-bit counter at offset i, spilling whatever doesn't fit. 
+ */
+static inline void buddha_add_compact(unsigned short* cells, buddha_spill* s,
+                                      size_t i, long long w) {
+    long long c = cells[i] + w;
+    if(c < COMPACT_MAX) {
+        cells[i] = (unsigned short)c;
+    } else {
+        cells[i] = COMPACT_MAX;
+        buddha_spill_add(s, i, c - COMPACT_MAX);
+    }
+}
+
+
+/**
+ * Returns the 16-bit counter at offset i with its spilled count. 
+ */
+static inline long long buddha_get_compact(unsigned short* cells, 
+                                           buddha_spill* s, size_t i) {
+    long long c = cells[i];
+    return c < COMPACT_MAX ? c : c + buddha_spill_get(s, i);
+}
+
+
+/**
+ * Options for a rendering run, as read from the command line and config 
+ * files. See buddha_set_option for what they mean. 
+ */
+typedef struct _buddha_options {
+    int width;
+    int height;
+    int iterations;
+    int nebula;
+    const char* output;
+    int threads;
+    int timeline;
+    int pin;
+    int single_pass;
+    int binned;
+    int layout;
+    int hot_bins;
+    int wide;
+    int compact;
+    int subdivide;
+    int verify_fill;
+    int escape_width;
+    int min_orbit, max_orbit;
+    int orbit_limit;
+    const char* kernel;
+    int reject;
+    int bulb_table;
+    int cycles;
+    double cycle_tolerance;
+    int symmetric;
+    double center_re;
+    double center_im;
+    double span;
+    double aspect;
+    int sampler;
+    int rotate;
+    int band_boost, band_dilate;
+    long long samples;
+    double spp;
+    double region[4];
+    unsigned long long seed;
+} buddha_options;
+
+
+/**
+ * Fills in the default options. 
+ */
+void buddha_options_init(buddha_options* o) {
+    o->width = WIDTH;
+    o->height = HEIGHT;
+    o->iterations = ITERATIONS;
+    o->nebula = 0;
+    o->output = OUTPUT;
+    o->threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if(o->threads < 1) {
+        o->threads = 1;
+    }
+    o->timeline = 0;
+    o->pin = PIN_NONE;
+    o->single_pass = 0;
+    o->binned = 0;
+    o->layout = LAYOUT_ROWS;
+    o->hot_bins = 0;
+    o->wide = 0;
+    o->compact = 0;
+    o->subdivide = 0;
+    o->verify_fill = 0;
+    o->escape_width = 0;
+    o->min_orbit = 1;
+    o->max_orbit = INT_MAX;
+    o->orbit_limit = 1 << 16;
+    o->kernel = NULL;
+    o->reject = 1;
+    o->bulb_table = 0;
+    o->cycles = 1;
+    o->cycle_tolerance = 0;
+    o->symmetric = 1;
+    o->center_re = CENTER_RE;
+    o->center_im = CENTER_IM;
+    o->span = SPAN;
+    o->aspect = ASPECT;
+    o->sampler = SAMPLER_GRID;
+    o->rotate = 0;
+    o->band_boost = 8;
+    o->band_dilate = 2;
+    o->samples = 0;
+    o->spp = 1;
+
+    // Every point c whose orbit could land anywhere lies within |c| <= 2. 
+    o->region[0] = -2;
+    o->region[1] = -2;
+    o->region[2] = 2;
+    o->region[3] = 2;
+    o->seed = SEED;
+}
+
+
+/**
+ * Sets the region of the complex plane that the image shows, and works 
+ * out the transforms between pixel and complex coordinates. span is the 
+ * width of the region along the real axis, and aspect its height over 
+ * its width. 
+ */
+void buddha_set_viewport(buddha* b, double center_re, double center_im, 
+                         double span, double aspect) {
+    double span_im = span * aspect;
+    b->re_min = center_re - span / 2;
+    b->re_max = center_re + span / 2;
+    b->im_min = center_im - span_im / 2;
+    b->im_max = center_im + span_im / 2;
+    b->center_im = center_im;
+    b->px_re = span / b->width;
+    b->half_px_im = span_im / (2.0 * b->height);
+    b->re_scale = b->width / span;
+    b->im_scale = b->height / span_im;
+}
+
+
 /**
  * Initializes a buddha struct with the given options. 
  */
-void buddha_init(buddha* b, int width, int height, int iterations, int nebula) {
-    b->escapes = (char*)malloc(sizeof(char) * width * height);
-    b->plot = (int*)malloc(sizeof(int) * width * height);
+void buddha_init(buddha* b, const buddha_options* o) {
+    int width = o->width, height = o->height;
+    int tile = 1 << PLOT_TILE_SHIFT;
+    b->layout = o->layout;
+    b->plot_tiles_across = (width + tile - 1) / tile;
+    b->plot_size = b->layout == LAYOUT_ROWS ? (size_t)width * height : 
+        (size_t)b->plot_tiles_across * ((height + tile - 1) / tile) * 
+        tile * tile;
+    b->escapes = NULL;
+    b->wide = o->wide;
+    b->compact = o->compact;
+    b->plot = NULL;
+    b->plot64 = NULL;
+    b->cells = NULL;
+    if(b->compact) {
+        b->cells = (unsigned short*)malloc(sizeof(unsigned short) * 
+                                           b->plot_size);
+    } else if(b->wide) {
+        b->plot64 = (long long*)malloc(sizeof(long long) * b->plot_size);
+    } else {
+        b->plot = (int*)malloc(sizeof(int) * b->plot_size);
+    }
+    buddha_spill_init(&b->spill);
     b->im = (char*)malloc(sizeof(char) * width * height * 3);
+    if((b->plot == NULL && b->plot64 == NULL && b->cells == NULL) || 
+       b->im == NULL) {
+        err(5, "Could not allocate the plot.");
+    }
     b->max = 0;
+    b->frequency_shift = 0;
     b->width = width;
     b->height = height;
-    b->iterations = iterations;
-    b->max_offs = width * height - 1;
-    b->nebula = nebula;
+    b->iterations = o->iterations;
+    b->max_offs = (size_t)width * height - 1;
+    b->nebula = o->nebula;
+    b->locals = NULL;
+    b->timeline = o->timeline;
+    b->pool = NULL;
+    b->pin = o->pin;
+    b->strips = NULL;
+    b->strip_sizes = NULL;
+    b->plot_cuts = NULL;
+    b->single_pass = o->single_pass;
+    b->binned = o->binned;
+    b->num_bins = ((b->plot_size - 1) >> BIN_SHIFT) + 1;
+    b->hot_bins = o->hot_bins;
+    b->hot_slots = NULL;
+    b->hot_list = NULL;
+    b->num_hot = 0;
+    b->subdivide = o->subdivide;
+    b->verify_fill = o->verify_fill;
+    b->filled = b->fill_errors = 0;
+    b->escape_width = o->escape_width;
+    if(b->escape_width == 0) {
+        b->escape_width = b->iterations - 1 <= ESCAPE_16_MAX ? 
+            ESCAPE_16 : ESCAPE_32;
+    }
+    b->longest_escape = 0;
+    b->min_orbit = o->min_orbit;
+    b->max_orbit = o->max_orbit;
+    b->orbit_limit = o->orbit_limit;
+    b->kernel = NULL;
+    b->kernel_name = NULL;
+    b->lanes = 1;
+    memset(&b->escape_lanes, 0, sizeof(buddha_lanes));
+    memset(&b->plot_lanes, 0, sizeof(buddha_lanes));
+    b->reject = o->reject;
+    b->bulb_table = o->bulb_table;
+    memset(b->rejected, 0, sizeof(b->rejected));
+    b->cycles = o->cycles;
+    b->cycle_tolerance = o->cycle_tolerance;
+    b->cycles_found = 0;
+    b->cycles_saved = 0;
+    b->symmetric = o->symmetric;
+    b->threads = o->threads;
+    buddha_set_viewport(b, o->center_re, o->center_im, o->span, o->aspect);
+    b->sampler = o->sampler;
+    b->rotate = o->rotate;
+    b->band_boost = o->band_boost;
+    b->band_dilate = o->band_dilate;
+    b->band_cells = NULL;
+    b->samples = o->samples ? o->samples : 
+        llround(o->spp * width * height);
+    memcpy(b->region, o->region, sizeof(b->region));
+    b->sample_im0 = b->region[1];
+    b->sample_mirror = 0;
+    b->seed = o->seed;
+    b->strata_x = b->strata_y = 1;
+    b->mh_proposed = b->mh_accepted = 0;
 
     // This will be allocated later when we know what the max is. 
     b->count_frequency = NULL;
 }
 
 
+void buddha_stop_pool(buddha* b);
+
+
 /**
- * Frees the memory allocated using buddha_init. 
+ * Frees the memory allocated using buddha_init, and stops the thread pool. 
  */
 void buddha_free(buddha* b) {
+    buddha_stop_pool(b);
     free(b->escapes);
     free(b->plot);
+    free(b->plot64);
+    free(b->cells);
+    buddha_spill_free(&b->spill);
     free(b->im);
+    free(b->band_cells);
 
     if(b->count_frequency) {
         free(b->count_frequency);
@@ -93,13 +854,6 @@ void buddha_free(buddha* b) {
 }
 
 
-void err(int code, char* msg) {
-    fprintf(stderr, msg);
-    fprintf(stderr, "\n");
-    exit(code);
-}
-
-
 /**
  * Converts double values (between 0 and 1) into an RGB value. 
  */
@@ -110,7 +864,7 @@ int rgb(double r, double g, double b) {
 }
 
 
-int rank_in_percentile(buddha* b, int lo, int hi, int c) {
+int rank_in_percentile(buddha* b, int lo, int hi, long long c) {
     double cl = b->percentile_limit[lo], 
         ch = b->percentile_limit[hi];
     return ((double)c - cl) / (ch - cl);
@@ -120,7 +874,7 @@ int rank_in_percentile(buddha* b, int lo, int hi, int c) {
 /**
  * Gets the color to plot given a counter value. 
  */
-int getcolor(buddha* b, int count) {
+int getcolor(buddha* b, long long count) {
     // Points not visited are black. 
     if(count == 0) {
         return 0;
@@ -177,185 +931,2918 @@ int getcolor(buddha* b, int count) {
 
 /**
  * Converts pixel coordinates into complex plane coordinates. 
+ *
+ * The imaginary part is measured from the center row in half-pixel 
+ * steps, so that rows y and height - y of a viewport centered on the 
+ * real axis come out as exact conjugates, which symmetric mode relies on. 
  */
 complex double px2cx(buddha* b, int x, int y) {
-    return ((3.0 / b->width * (double)x) - 2) + 
-        ((2.0 / b->height * (double)y) - 1) * I;
+    return CMPLX(b->re_min + x * b->px_re, 
+                 b->center_im + (2 * y - b->height) * b->half_px_im);
 }
 
 
 /**
- * Converts complex plane coordinates into pixel coordinates.
+ * Converts complex plane coordinates into pixel coordinates. z should 
+ * be inside the viewport. 
  */
 void cx2px(buddha* b, complex double z, int* x, int* y) {
-    *x = (int)((creal(z) + 2) * b->width / 3);
-    *y = (int)((cimag(z) + 1) * b->height / 2);
+    *x = (int)((creal(z) - b->re_min) * b->re_scale);
+    *y = (int)((cimag(z) - b->im_min) * b->im_scale);
 }
 
 
 /**
- * Iterates at the given pixel coordinates up to the maximum number of 
- * iterations, or until the point escapes (meaning it is known to not be
- * in the Mandelbrot set). 
- *
- * Optionally, invokes a callback with every iteration, giving the buddha
- * structure along with the current value. 
- *
- * Returns the number of iterations performed, which is either b->iterations
- * if the point is in the Mandelbrot set, or a smaller number otherwise. 
+ * Spreads the low bits of v out to the even bits of the result. 
  */
-int iterate(buddha* b, int x, int y, void (*cb)(buddha*, complex double)) {
-    complex double z = 0, c = px2cx(b, x, y);
-    int i = 1;
-    for(; i < b->iterations; i++) {
-        z = z*z + c;
-        if(cabs(z) >= 2) {
-            break;
-        }
-        if(cb != NULL) {
-            cb(b, z);
-        }
-    }
-    return i;
+static inline int buddha_spread_bits(int v) {
+    v = (v | (v << 4)) & 0x0f0f;
+    v = (v | (v << 2)) & 0x3333;
+    return (v | (v << 1)) & 0x5555;
 }
 
 
 /**
- * Plots a pixel in the output image given a coordinate and its count. 
+ * Returns the offset in the histogram of the counter for pixel (x, y), 
+ * in whichever layout it has. In the tiled layouts, points that are near 
+ * each other in the image tend to be near each other in memory whichever 
+ * way they are apart, whereas in rows a pixel's neighbors above and below 
+ * are a whole row away. 
  */
-void putpixel(buddha* b, int c, int x, int y) {
-    int offs = y * b->width * 3 + x * 3;
-    b->im[offs] = RED(c);
-    b->im[offs+1] = GREEN(c);
-    b->im[offs+2] = BLUE(c);
+static inline size_t buddha_plot_offset(buddha* b, int x, int y) {
+    if(b->layout == LAYOUT_ROWS) {
+        return (size_t)y * b->width + x;
+    }
+    int mask = (1 << PLOT_TILE_SHIFT) - 1, tx = x & mask, ty = y & mask;
+    size_t tile = (size_t)(y >> PLOT_TILE_SHIFT) * b->plot_tiles_across + 
+        (x >> PLOT_TILE_SHIFT);
+    int in = b->layout == LAYOUT_MORTON ? 
+        buddha_spread_bits(tx) | buddha_spread_bits(ty) << 1 : 
+        ty << PLOT_TILE_SHIFT | tx;
+    return (tile << (2 * PLOT_TILE_SHIFT)) + in;
 }
 
 
 /**
- * Performs the first pass of rendering. This computes which points 
- * in the image are not in the Mandelbrot set. 
+ * Returns the count in the plot at offset i. 
  */
-void buddha_calc_escapes(buddha* b) {
-    int x, y;
-    for(x = 0; x < b->width; x++) {
-        for(y = 0; y < b->height; y++) {
-            int offs = y * b->width + x;
-            int its = iterate(b, x, y, NULL);
-            if(its != ITERATIONS) {
-                b->escapes[offs] = 1;
-            } else {
-                b->escapes[offs] = 0;
-            }
-        }
+static inline long long buddha_count(buddha* b, size_t i) {
+    if(b->compact) {
+        return buddha_get_compact(b->cells, &b->spill, i);
     }
+    return b->wide ? b->plot64[i] : b->plot[i];
 }
 
 
 /**
- * Called with each iteration while plotting the points that escape. 
- * This increments the appropriate counter for the complex point. It 
- * also keeps track of the maximum counter. 
+ * Returns the count in the plot for pixel (x, y). 
  */
-void buddha_plot_callback(buddha* b, complex double z) {
-    int x, y;
-    cx2px(b, z, &x, &y);
-    
+static inline long long buddha_plot_at(buddha* b, int x, int y) {
+    return buddha_count(b, buddha_plot_offset(b, x, y));
+}
+
+
+/**
+ * Finds the offset in the histogram of the pixel containing the complex 
+ * point. Returns 0 if the point is outside of the image. 
+ */
+static inline int buddha_pixel(buddha* b, complex double z, size_t* offs) {
+    double re = creal(z), im = cimag(z);
+
     // Note that it's perfectly acceptable for z to stray outside of 
-    // the image bounds. 
-    int offs = y * b->width + x;
-    if(offs < 0 || offs > b->max_offs) {
-        return;
+    // the image bounds, and in a zoomed view most points do, so those 
+    // are thrown out before doing any index arithmetic. 
+    if(!(re >= b->re_min && re < b->re_max && 
+         im >= b->im_min && im < b->im_max)) {
+        return 0;
     }
 
-    b->plot[offs]++;
-    
-    if(b->plot[offs] > b->max) {
-        b->max = b->plot[offs];
+    // Rounding can still put a point just inside the far edge on the 
+    // pixel past it. 
+    int x, y;
+    cx2px(b, z, &x, &y);
+    if(x >= b->width || y >= b->height) {
+        return 0;
     }
+    *offs = buddha_plot_offset(b, x, y);
+    return 1;
 }
 
 
 /**
- * Performs a second iteration for each point in the image that is not 
- * in the Mandelbrot set. At each iteration the value of z is counted
- * using buddha_plot_callback. This also computes and sets the structure's
- * mean field. 
+ * Adds w to an int counter, noting in the thread's overflow bits if it 
+ * goes past INT_MAX. The sum is done unsigned, where wrapping is defined. 
  */
-void buddha_plot_escapes(buddha* b) {
-    int x, y;
-    for(x = 0; x < b->width; x++) {
-        for(y = 0; y < b->height; y++) {
-            int offs = y * b->width + x;
-            if(b->escapes[offs] == 1) {
-                iterate(b, x, y, &buddha_plot_callback);
-            }
-        }
-    }
+static inline void buddha_add_int(buddha_local* l, int* c, int w) {
+    unsigned int sum = (unsigned int)*c + w;
+    *c = (int)sum;
+    l->overflow |= sum;
 }
 
 
 /**
- * Prints out overall stats and a text histogram of the plot counts. 
+ * Adds w to an int counter in the shared plot of a hybrid histogram, 
+ * which other threads may be adding to at the same time. 
  */
-void buddha_print_stats(buddha* b) {
-    printf("Iterations: %d\n", b->iterations);
-    printf("Dimensions: %dx%dpx\n", b->width, b->height);
-    printf("Mean count: %d\n", b->mean);
-    printf("Max count: %d\n", b->max);
+static inline void buddha_add_shared(buddha_local* l, int* c, int w) {
+    int old = atomic_fetch_add_explicit((atomic_int*)c, w, 
+                                        memory_order_relaxed);
+    l->overflow |= (unsigned int)old + w;
+}
 
-    int ranges[20] = {0};
-    double twentieth = (double)b->max / 20;
-    int i = 0, n = 0;
-    for(; i <= b->max_offs; i++) {
-        int c = b->plot[i];
-        if(c != 0) {
-            int j = 1;
-            for(; j <= 20; j++) {
-                if(c < twentieth*j) {
-                    break;
-                }
-            }
 
-            n++;
-            ranges[j-1]++;
-        }
+/**
+ * Adds w to the counter at offset i of the calling thread's histogram. 
+ * With a hybrid histogram, the counter is in the thread's own copy of its 
+ * bin if that is hot, and otherwise in the shared plot, which other 
+ * threads may be adding to at the same time. 
+ */
+static inline void buddha_add(buddha* b, buddha_local* l, size_t i, int w) {
+    if(b->compact) {
+        buddha_add_compact(l->cells, l->spill, i, w);
+        return;
     }
-
-    double pct_escaped = (double)n / b->max_offs * 100;
-    printf("Escaping points: %d (%.2f%%)\n", n, pct_escaped);
-
-    printf("\nHistogram:\n");
-    float cum_pct = 0;
-    for(i = 0; i < 20; i++) {
-        int low = twentieth*i;
-        int hi = twentieth*(i+1);
-        int c = ranges[i];
-        float pct = (float)c / n * 100;
-        cum_pct += pct;
-        printf("%2d %4d   - %4d %15d  %3.2f  %3.2f\n", 
-               i+1, low, hi, c, pct, cum_pct);
+    if(b->hot_slots == NULL) {
+        if(b->wide) {
+            l->plot64[i] += w;
+        } else {
+            buddha_add_int(l, &l->plot[i], w);
+        }
+        return;
     }
-
-    printf("\nPercentile limits:\n");
-    for(i = 0; i < 10; i++) {
-        printf("%2d%%  %d\n", (i+1)*10, b->percentile_limit[i]);
+    int s = b->hot_slots[i >> BIN_SHIFT];
+    if(s < 0 && b->wide) {
+        atomic_fetch_add_explicit((atomic_llong*)&b->plot64[i], w, 
+                                  memory_order_relaxed);
+    } else if(s < 0) {
+        buddha_add_shared(l, &b->plot[i], w);
+    } else {
+        size_t h = ((size_t)s << BIN_SHIFT) + (i & ((1 << BIN_SHIFT) - 1));
+        if(b->wide) {
+            l->hot64[h] += w;
+        } else {
+            buddha_add_int(l, &l->hot[h], w);
+        }
     }
-    printf("\n");
 }
 
 
 /**
- * Renders the final image. Used after the escaping values have been
- * found and plotted. 
+ * Adds the pending increments of bin k to the thread's histogram, in one 
+ * burst while that part of the histogram is in cache. 
  */
-void buddha_draw(buddha* b) {
-    int x, y;
-    for(x = 0; x < b->width; x++) {
-        for(y = 0; y < b->height; y++) {
-            int offs = y * b->width + x;
-            int count = b->plot[offs];
-            int c = getcolor(b, count);
-            putpixel(b, c, x, y);
+void buddha_flush_bin(buddha* b, buddha_local* l, int k) {
+    unsigned short* bin = l->bins + (size_t)k * BIN_SIZE;
+    size_t lo = (size_t)k << BIN_SHIFT;
+    int i, n = l->bin_fill[k], w = l->weight;
+    int* plot = NULL;
+    long long* plot64 = NULL;
+    l->bin_fill[k] = 0;
+    if(b->compact) {
+        for(i = 0; i < n; i++) {
+            buddha_add_compact(l->cells, l->spill, lo + bin[i], w);
+        }
+        return;
+    }
+    if(b->wide) {
+        if(b->hot_slots == NULL) {
+            plot64 = l->plot64 + lo;
+        } else if(b->hot_slots[k] >= 0) {
+            plot64 = l->hot64 + ((size_t)b->hot_slots[k] << BIN_SHIFT);
+        } else {
+            plot64 = b->plot64 + lo;
+            for(i = 0; i < n; i++) {
+                atomic_fetch_add_explicit((atomic_llong*)&plot64[bin[i]], w, 
+                                          memory_order_relaxed);
+            }
+            return;
+        }
+        for(i = 0; i < n; i++) {
+            plot64[bin[i]] += w;
+        }
+        return;
+    }
+    if(b->hot_slots == NULL) {
+        plot = l->plot + lo;
+    } else if(b->hot_slots[k] >= 0) {
+        plot = l->hot + ((size_t)b->hot_slots[k] << BIN_SHIFT);
+    }
+    if(plot != NULL) {
+        for(i = 0; i < n; i++) {
+            buddha_add_int(l, &plot[bin[i]], w);
+        }
+    } else {
+        for(i = 0; i < n; i++) {
+            buddha_add_shared(l, &b->plot[lo + bin[i]], w);
+        }
+    }
+}
+
+
+/**
+ * Adds all of the thread's pending increments to its histogram. This has 
+ * to be done before the weight changes, and at the end of the plot pass. 
+ */
+void buddha_flush_bins(buddha* b, buddha_local* l) {
+    int k;
+    if(l->bins == NULL) {
+        return;
+    }
+    for(k = 0; k < b->num_bins; k++) {
+        if(l->bin_fill[k]) {
+            buddha_flush_bin(b, l, k);
+        }
+    }
+}
+
+
+/**
+ * Increments the counter for the complex point in the calling thread's 
+ * histogram. With binned plotting the increment is put in the bin for 
+ * its part of the histogram, which is added in once it fills. An orbit 
+ * lands all over the histogram, so incrementing counters as they come 
+ * misses the cache on almost every point on a large image. 
+ */
+void buddha_plot_count(buddha* b, buddha_local* l, complex double z) {
+    size_t i;
+    if(!buddha_pixel(b, z, &i)) {
+        return;
+    }
+    if(l->bins == NULL) {
+        buddha_add(b, l, i, l->weight);
+        return;
+    }
+    int k = (int)(i >> BIN_SHIFT);
+    l->bins[(size_t)k * BIN_SIZE + l->bin_fill[k]] = 
+        (unsigned short)(i & ((1 << BIN_SHIFT) - 1));
+    if(++l->bin_fill[k] == BIN_SIZE) {
+        buddha_flush_bin(b, l, k);
+    }
+}
+
+
+/**
+ * Called with each iteration while plotting the points that escape. 
+ * This counts z, and also its conjugate if the conjugate of the point 
+ * being iterated isn't going to be iterated itself. 
+ */
+void buddha_plot_callback(buddha* b, buddha_local* l, complex double z) {
+    buddha_plot_count(b, l, z);
+    if(l->mirror) {
+        buddha_plot_count(b, l, conj(z));
+    }
+}
+
+
+/**
+ * Discs that lie inside the Mandelbrot set, one in each of the larger 
+ * bulbs of period 3 to 5 along the main cardioid and the real axis. Each 
+ * is centered near the bulb's nucleus with a radius somewhat inside its 
+ * boundary, checked by iterating points on and within the disc. 
+ */
+const double bulb_discs[][3] = {
+    { -0.12256116687665,  0.74486176661974, 0.078 },
+    { -0.12256116687665, -0.74486176661974, 0.078 },
+    { -1.31070264133683,  0,                0.0487 },
+    { -1.75487766624669,  0,                0.0043 },
+    {  0.28227,           0.53006,          0.036 },
+    {  0.28227,          -0.53006,          0.036 },
+    { -0.50434,           0.56276,          0.0326 },
+    { -0.50434,          -0.56276,          0.0326 },
+    {  0.37951,           0.33464,          0.019 },
+    {  0.37951,          -0.33464,          0.019 },
+};
+
+
+/**
+ * Tests whether c = cr + ci*I is known to be in the Mandelbrot set without
+ * iterating it. Points in the main cardioid and the period-2 bulb would 
+ * otherwise burn through every iteration only to be found not to escape, 
+ * and there are closed-form tests for both. 
+ *
+ * Returns nonzero, and counts the rejection, if the point can be skipped. 
+ */
+int buddha_reject(buddha* b, buddha_local* l, double cr, double ci) {
+    if(!b->reject) {
+        return 0;
+    }
+
+    double x = cr - 0.25, y2 = ci * ci, q = x * x + y2;
+    if(q * (q + x) < 0.25 * y2) {
+        l->rejected[0]++;
+        return 1;
+    }
+    if((cr + 1) * (cr + 1) + y2 < 0.0625) {
+        l->rejected[1]++;
+        return 1;
+    }
+
+    if(b->bulb_table) {
+        int i, n = sizeof(bulb_discs) / sizeof(bulb_discs[0]);
+        for(i = 0; i < n; i++) {
+            double dx = cr - bulb_discs[i][0], dy = ci - bulb_discs[i][1];
+            if(dx * dx + dy * dy < bulb_discs[i][2] * bulb_discs[i][2]) {
+                l->rejected[2]++;
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Iterates the point c = cr + ci*I up to the maximum number of 
+ * iterations, or until the point escapes (meaning it is known to not be
+ * in the Mandelbrot set). 
+ *
+ * Optionally, invokes a callback with every iteration, giving the buddha
+ * structure and the calling thread's state along with the current value. 
+ *
+ * Returns the number of iterations performed, which is either b->iterations
+ * if the point is in the Mandelbrot set, or a smaller number otherwise. 
+ *
+ * The arithmetic here is spelled out on the real and imaginary parts, and 
+ * the bailout compares |z|^2 against 4 rather than taking a square root. 
+ * The vectorized kernels below do exactly the same operations in the same 
+ * order, so that they agree with this on every point. 
+ */
+int iterate(buddha* b, double cr, double ci, 
+            void (*cb)(buddha*, buddha_local*, complex double), 
+            buddha_local* l) {
+    double zr = 0, zi = 0;
+    int i = 1;
+    for(; i < b->iterations; i++) {
+        double t = zr*zr - zi*zi + cr;
+        zi = 2*zr*zi + ci;
+        zr = t;
+        if(zr*zr + zi*zi >= 4) {
+            break;
+        }
+        if(cb != NULL) {
+            cb(b, l, CMPLX(zr, zi));
+        }
+    }
+    return i;
+}
+
+
+/**
+ * Counts an orbit recorded by a kernel into the thread's histogram. 
+ */
+void buddha_plot_orbit(buddha* b, buddha_local* l, 
+                       const double* re, const double* im, int len) {
+    int i;
+    for(i = 0; i < len; i++) {
+        buddha_plot_callback(b, l, CMPLX(re[i], im[i]));
+    }
+}
+
+
+/**
+ * Finishes a point in the plot pass once a kernel knows how many 
+ * iterations it took. An escaping orbit is counted from the lane's 
+ * buffer, or iterated again if it was too long to fit. Orbits of points 
+ * in the set are dropped. 
+ */
+void buddha_plot_finish(buddha* b, buddha_local* l, int lane, 
+                        double cr, double ci, int its) {
+    if(its == b->iterations || its < b->min_orbit || its > b->max_orbit) {
+        return;
+    }
+    if(its - 1 > l->orbit_len) {
+        iterate(b, cr, ci, &buddha_plot_callback, l);
+        return;
+    }
+    buddha_plot_orbit(b, l, l->orbit_re + lane * l->orbit_len, 
+                      l->orbit_im + lane * l->orbit_len, its - 1);
+}
+
+
+/**
+ * Escape-time kernel that handles one point at a time. Used where no 
+ * vector unit is available. 
+ *
+ * All of the kernels look for cycles using Brent's method: z is saved at 
+ * iterations 1, 2, 4, 8 and so on, and compared with every later value 
+ * until the next save. An orbit that comes back to a saved value is 
+ * periodic and will never escape, however many iterations remain. With 
+ * the default tolerance of 0 only exact repeats count, and since the 
+ * iteration is deterministic this can never misclassify a point. A 
+ * positive tolerance catches attracting cycles sooner, but trusts that 
+ * an orbit that passes that close to an earlier value is caught in one, 
+ * which isn't always so; that is why it is opt-in and bounded by 
+ * CYCLE_TOLERANCE_MAX. 
+ */
+void kernel_scalar(buddha* b, buddha_local* l, const double* cr, 
+                   const double* ci, int n, int* its) {
+    double* ore = l->orbit_re, *oim = l->orbit_im;
+    double tol = b->cycle_tolerance;
+    int j;
+    for(j = 0; j < n; j++) {
+        double zr = 0, zi = 0, sr = 0, si = 0;
+        long long check = 1;
+        int i = 1, cycle = 0;
+        for(; i < b->iterations; i++) {
+            double t = zr*zr - zi*zi + cr[j];
+            zi = 2*zr*zi + ci[j];
+            zr = t;
+            if(zr*zr + zi*zi >= 4) {
+                break;
+            }
+            if(b->cycles) {
+                if(fabs(zr - sr) <= tol && fabs(zi - si) <= tol) {
+                    cycle = 1;
+                    break;
+                }
+                if(i == check) {
+                    sr = zr;
+                    si = zi;
+                    check *= 2;
+                }
+            }
+            if(its == NULL && i <= l->orbit_len) {
+                ore[i-1] = zr;
+                oim[i-1] = zi;
+            }
+        }
+        l->lanes.slots += i;
+        l->lanes.busy += i;
+        if(cycle) {
+            l->cycles++;
+            l->cycles_saved += b->iterations - i;
+            i = b->iterations;
+        }
+        if(its != NULL) {
+            its[j] = i;
+        } else {
+            buddha_plot_finish(b, l, 0, cr[j], ci[j], i);
+        }
+    }
+}
+
+
+#ifdef BUDDHA_X86
+
+/**
+ * Clears the highest set bits of a lane mask until at most n are left. 
+ */
+int lanes_take(int mask, int n) {
+    while(__builtin_popcount(mask) > n) {
+        mask &= ~(1 << (31 - __builtin_clz(mask)));
+    }
+    return mask;
+}
+
+
+/**
+ * AVX2 escape-time kernel, iterating four points at once. 
+ *
+ * Orbit lengths vary wildly between neighboring points, so rather than 
+ * iterating groups of four until the slowest is done, each lane works 
+ * through the queue on its own: as soon as a lane escapes or reaches the 
+ * iteration limit its result is written out and it picks up the next 
+ * point. AVX2 can't load into selected lanes, so the lane state goes 
+ * through memory when that happens, which is once per point rather than 
+ * once per iteration. 
+ *
+ * In the plot pass (its is NULL) each lane also records its orbit, which 
+ * is counted into the histogram when the point escapes. 
+ *
+ * Cycles are detected as in kernel_scalar, with a saved value and next 
+ * save point kept for each lane. 
+ */
+__attribute__((target("avx2")))
+void kernel_avx2(buddha* b, buddha_local* l, const double* cr, 
+                 const double* ci, int n, int* its) {
+    const __m256d four = _mm256_set1_pd(4.0);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256i last = _mm256_set1_epi64x(b->iterations - 2);
+    const __m256d tol = _mm256_set1_pd(b->cycle_tolerance);
+    const __m256d abs = _mm256_castsi256_pd(
+        _mm256_set1_epi64x(0x7fffffffffffffffLL));
+    __m256d zr = _mm256_setzero_pd(), zi = _mm256_setzero_pd();
+    __m256d vcr = _mm256_setzero_pd(), vci = _mm256_setzero_pd();
+    __m256d sr = _mm256_setzero_pd(), si = _mm256_setzero_pd();
+    __m256i it = one, check = one;
+    double ar[4], ai[4], acr[4], aci[4], asr[4], asi[4];
+    long long ait[4], acheck[4];
+    int idx[4] = {0}, active = 0, refill = 0xf, next = 0, k;
+    long long steps = 0, busy = 0;
+    for(;;) {
+        refill = lanes_take(refill, n - next);
+        if(refill) {
+            _mm256_storeu_pd(ar, zr);
+            _mm256_storeu_pd(ai, zi);
+            _mm256_storeu_pd(acr, vcr);
+            _mm256_storeu_pd(aci, vci);
+            _mm256_storeu_pd(asr, sr);
+            _mm256_storeu_pd(asi, si);
+            _mm256_storeu_si256((__m256i*)ait, it);
+            _mm256_storeu_si256((__m256i*)acheck, check);
+            for(k = 0; k < 4; k++) {
+                if(refill & (1 << k)) {
+                    ar[k] = ai[k] = asr[k] = asi[k] = 0;
+                    acr[k] = cr[next];
+                    aci[k] = ci[next];
+                    ait[k] = acheck[k] = 1;
+                    idx[k] = next++;
+                }
+            }
+            zr = _mm256_loadu_pd(ar);
+            zi = _mm256_loadu_pd(ai);
+            vcr = _mm256_loadu_pd(acr);
+            vci = _mm256_loadu_pd(aci);
+            sr = _mm256_loadu_pd(asr);
+            si = _mm256_loadu_pd(asi);
+            it = _mm256_loadu_si256((__m256i*)ait);
+            check = _mm256_loadu_si256((__m256i*)acheck);
+            active |= refill;
+        }
+        if(active == 0) {
+            break;
+        }
+
+        __m256d zr2 = _mm256_mul_pd(zr, zr), zi2 = _mm256_mul_pd(zi, zi);
+        __m256d t = _mm256_add_pd(_mm256_sub_pd(zr2, zi2), vcr);
+        zi = _mm256_add_pd(_mm256_mul_pd(_mm256_add_pd(zr, zr), zi), vci);
+        zr = t;
+        __m256d mag = _mm256_add_pd(_mm256_mul_pd(zr, zr), 
+                                    _mm256_mul_pd(zi, zi));
+        int esc = _mm256_movemask_pd(_mm256_cmp_pd(mag, four, _CMP_GE_OQ));
+        int lim = _mm256_movemask_pd(
+            _mm256_castsi256_pd(_mm256_cmpgt_epi64(it, last)));
+        esc &= active;
+        lim &= active & ~esc;
+        int cyc = 0;
+        if(b->cycles) {
+            __m256d dr = _mm256_and_pd(_mm256_sub_pd(zr, sr), abs);
+            __m256d di = _mm256_and_pd(_mm256_sub_pd(zi, si), abs);
+            cyc = _mm256_movemask_pd(_mm256_and_pd(
+                _mm256_cmp_pd(dr, tol, _CMP_LE_OQ), 
+                _mm256_cmp_pd(di, tol, _CMP_LE_OQ)));
+            cyc &= active & ~esc;
+            __m256i save = _mm256_cmpeq_epi64(it, check);
+            sr = _mm256_blendv_pd(sr, zr, _mm256_castsi256_pd(save));
+            si = _mm256_blendv_pd(si, zi, _mm256_castsi256_pd(save));
+            check = _mm256_add_epi64(check, _mm256_and_si256(check, save));
+        }
+        steps++;
+        busy += __builtin_popcount(active);
+
+        if(its == NULL || esc | lim | cyc) {
+            _mm256_storeu_si256((__m256i*)ait, it);
+        }
+        if(its == NULL) {
+            int rec = active & ~esc;
+            _mm256_storeu_pd(ar, zr);
+            _mm256_storeu_pd(ai, zi);
+            for(k = 0; k < 4; k++) {
+                if((rec & (1 << k)) && ait[k] <= l->orbit_len) {
+                    l->orbit_re[k * l->orbit_len + ait[k] - 1] = ar[k];
+                    l->orbit_im[k * l->orbit_len + ait[k] - 1] = ai[k];
+                }
+            }
+        }
+        refill = esc | lim | cyc;
+        for(k = 0; k < 4; k++) {
+            if(refill & (1 << k)) {
+                int count = (esc & (1 << k)) ? ait[k] : b->iterations;
+                if(cyc & (1 << k)) {
+                    l->cycles++;
+                    l->cycles_saved += b->iterations - ait[k];
+                }
+                if(its != NULL) {
+                    its[idx[k]] = count;
+                } else {
+                    buddha_plot_finish(b, l, k, cr[idx[k]], ci[idx[k]], 
+                                       count);
+                }
+            }
+        }
+        active &= ~refill;
+        it = _mm256_add_epi64(it, one);
+    }
+    l->lanes.slots += steps * 4;
+    l->lanes.busy += busy;
+}
+
+
+/**
+ * AVX-512 escape-time kernel. This works like kernel_avx2 with eight 
+ * lanes, but finished lanes are refilled in registers with expanding 
+ * loads, and orbits are recorded with scatters. 
+ */
+__attribute__((target("avx512f")))
+void kernel_avx512(buddha* b, buddha_local* l, const double* cr, 
+                   const double* ci, int n, int* its) {
+    const __m512d four = _mm512_set1_pd(4.0), zero = _mm512_setzero_pd();
+    const __m512i one = _mm512_set1_epi64(1);
+    const __m512i last = _mm512_set1_epi64(b->iterations - 1);
+    const __m512i orbit_len = _mm512_set1_epi64(l->orbit_len);
+    const __m512i iota = _mm512_set_epi64(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m512d tol = _mm512_set1_pd(b->cycle_tolerance);
+    const int len = l->orbit_len;
+    const __m512i base = _mm512_set_epi64(7*len - 1, 6*len - 1, 5*len - 1, 
+                                          4*len - 1, 3*len - 1, 2*len - 1, 
+                                          len - 1, -1);
+    __m512d zr = zero, zi = zero, vcr = zero, vci = zero, sr = zero, si = zero;
+    __m512i it = one, check = one, idx = _mm512_setzero_si512();
+    long long ait[8], aidx[8];
+    __mmask8 active = 0, refill = 0xff;
+    int next = 0, k;
+    long long steps = 0, busy = 0;
+    for(;;) {
+        refill = lanes_take(refill, n - next);
+        if(refill) {
+            vcr = _mm512_mask_expandloadu_pd(vcr, refill, cr + next);
+            vci = _mm512_mask_expandloadu_pd(vci, refill, ci + next);
+            idx = _mm512_mask_expand_epi64(idx, refill, 
+                _mm512_add_epi64(iota, _mm512_set1_epi64(next)));
+            zr = _mm512_mask_mov_pd(zr, refill, zero);
+            zi = _mm512_mask_mov_pd(zi, refill, zero);
+            sr = _mm512_mask_mov_pd(sr, refill, zero);
+            si = _mm512_mask_mov_pd(si, refill, zero);
+            it = _mm512_mask_mov_epi64(it, refill, one);
+            check = _mm512_mask_mov_epi64(check, refill, one);
+            active |= refill;
+            next += __builtin_popcount(refill);
+        }
+        if(active == 0) {
+            break;
+        }
+
+        __m512d zr2 = _mm512_mul_pd(zr, zr), zi2 = _mm512_mul_pd(zi, zi);
+        __m512d t = _mm512_add_pd(_mm512_sub_pd(zr2, zi2), vcr);
+        zi = _mm512_add_pd(_mm512_mul_pd(_mm512_add_pd(zr, zr), zi), vci);
+        zr = t;
+        __m512d mag = _mm512_add_pd(_mm512_mul_pd(zr, zr), 
+                                    _mm512_mul_pd(zi, zi));
+        __mmask8 esc = _mm512_mask_cmp_pd_mask(active, mag, four, _CMP_GE_OQ);
+        __mmask8 lim = _mm512_mask_cmpge_epi64_mask(active & ~esc, it, last);
+        __mmask8 cyc = 0;
+        if(b->cycles) {
+            cyc = _mm512_mask_cmp_pd_mask(active & ~esc, 
+                _mm512_abs_pd(_mm512_sub_pd(zr, sr)), tol, _CMP_LE_OQ);
+            cyc = _mm512_mask_cmp_pd_mask(cyc, 
+                _mm512_abs_pd(_mm512_sub_pd(zi, si)), tol, _CMP_LE_OQ);
+            __mmask8 save = _mm512_mask_cmpeq_epi64_mask(active, it, check);
+            sr = _mm512_mask_mov_pd(sr, save, zr);
+            si = _mm512_mask_mov_pd(si, save, zi);
+            check = _mm512_mask_add_epi64(check, save, check, check);
+        }
+        steps++;
+        busy += __builtin_popcount(active);
+
+        if(its == NULL) {
+            __mmask8 rec = _mm512_mask_cmple_epi64_mask(active & ~esc, 
+                                                        it, orbit_len);
+            __m512i pos = _mm512_add_epi64(base, it);
+            _mm512_mask_i64scatter_pd(l->orbit_re, rec, pos, zr, 8);
+            _mm512_mask_i64scatter_pd(l->orbit_im, rec, pos, zi, 8);
+        }
+        refill = esc | lim | cyc;
+        if(refill) {
+            __m512i count = _mm512_mask_mov_epi64(
+                it, lim | cyc, _mm512_set1_epi64(b->iterations));
+            _mm512_storeu_si512(aidx, idx);
+            if(cyc) {
+                _mm512_storeu_si512(ait, it);
+                for(k = 0; k < 8; k++) {
+                    if(cyc & (1 << k)) {
+                        l->cycles++;
+                        l->cycles_saved += b->iterations - ait[k];
+                    }
+                }
+            }
+            _mm512_storeu_si512(ait, count);
+            for(k = 0; k < 8; k++) {
+                if(refill & (1 << k)) {
+                    if(its != NULL) {
+                        its[aidx[k]] = ait[k];
+                    } else {
+                        buddha_plot_finish(b, l, k, cr[aidx[k]], 
+                                           ci[aidx[k]], ait[k]);
+                    }
+                }
+            }
+            active &= ~refill;
+        }
+        it = _mm512_add_epi64(it, one);
+    }
+    l->lanes.slots += steps * 8;
+    l->lanes.busy += busy;
+}
+
+#endif
+
+
+/**
+ * Picks the escape-time kernel for the given name, or the widest one 
+ * this CPU supports if name is NULL. Returns 0 if the named kernel isn't 
+ * available. 
+ */
+int buddha_set_kernel(buddha* b, const char* name) {
+#ifdef BUDDHA_X86
+    __builtin_cpu_init();
+    if((name == NULL || !strcmp(name, "avx512")) && 
+       __builtin_cpu_supports("avx512f")) {
+        b->kernel = &kernel_avx512;
+        b->kernel_name = "avx512";
+        b->lanes = 8;
+        return 1;
+    }
+    if((name == NULL || !strcmp(name, "avx2")) && 
+       __builtin_cpu_supports("avx2")) {
+        b->kernel = &kernel_avx2;
+        b->kernel_name = "avx2";
+        b->lanes = 4;
+        return 1;
+    }
+#endif
+    if(name == NULL || !strcmp(name, "scalar")) {
+        b->kernel = &kernel_scalar;
+        b->kernel_name = "scalar";
+        b->lanes = 1;
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Plots a pixel in the output image given a coordinate and its count. 
+ */
+void putpixel(buddha* b, int c, int x, int y) {
+    size_t offs = ((size_t)y * b->width + x) * 3;
+    b->im[offs] = RED(c);
+    b->im[offs+1] = GREEN(c);
+    b->im[offs+2] = BLUE(c);
+}
+
+
+/**
+ * A run of work units, i0 through i1 - 1, handed out as one task. 
+ */
+typedef struct _buddha_task {
+    int i0, i1;
+} buddha_task;
+
+
+/**
+ * A thread of the pool. Its deque holds the tasks it was dealt for the 
+ * current pass: it takes them from the front, and workers that have run 
+ * out steal them from the back. It also records the times (in seconds 
+ * from the start of the pass) at which it started and finished each 
+ * task, and how many of those it stole. 
+ */
+typedef struct _buddha_worker {
+    struct _buddha_pool* pool;
+    int thread;
+    pthread_mutex_t lock;
+    buddha_task* tasks;
+    int head, tail;
+    double* spans;
+    int num_spans, max_spans;
+    int steals;
+} buddha_worker;
+
+
+/**
+ * The thread pool that runs every parallel pass of a render. The threads 
+ * are started once, with the calling thread as worker 0, and wait for a 
+ * new generation between passes. 
+ */
+typedef struct _buddha_pool {
+    buddha* b;
+    buddha_worker* workers;
+    pthread_t* ids;
+    pthread_mutex_t lock;
+    pthread_cond_t wake, done;
+    int generation, running, quit;
+    void (*fn)(buddha*, int, int, int);
+    double start;
+} buddha_pool;
+
+
+double buddha_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+
+/**
+ * Pins the calling thread, worker t, to a CPU according to b->pin: 
+ * compact puts worker t on CPU t, and spread spaces the workers evenly 
+ * over the CPUs. Pinning is only supported on Linux. 
+ */
+void buddha_pin(buddha* b, int t) {
+#ifdef __linux__
+    int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN), cpu;
+    if(b->pin == PIN_NONE || cpus < 1) {
+        return;
+    }
+    cpu = b->pin == PIN_SPREAD && b->threads < cpus ? 
+        t * cpus / b->threads : t % cpus;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)b;
+    (void)t;
+#endif
+}
+
+
+/**
+ * Takes the next task from the front of the worker's own deque, or steals 
+ * one from the back of another's. Returns 0 when there are none left. 
+ */
+int buddha_next_task(buddha_worker* w, buddha_task* task) {
+    buddha_pool* p = w->pool;
+    int i, found = 0;
+    pthread_mutex_lock(&w->lock);
+    if(w->head < w->tail) {
+        *task = w->tasks[w->head++];
+        found = 1;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    for(i = 1; i < p->b->threads && !found; i++) {
+        buddha_worker* v = &p->workers[(w->thread + i) % p->b->threads];
+        pthread_mutex_lock(&v->lock);
+        if(v->head < v->tail) {
+            *task = v->tasks[--v->tail];
+            found = 1;
+            w->steals++;
+        }
+        pthread_mutex_unlock(&v->lock);
+    }
+    return found;
+}
+
+
+/**
+ * Runs tasks of the current pass until there are none left, recording 
+ * when each one ran. 
+ */
+void buddha_worker_run(buddha_worker* w) {
+    buddha_pool* p = w->pool;
+    buddha_task task;
+    while(buddha_next_task(w, &task)) {
+        double t0 = buddha_now() - p->start;
+        p->fn(p->b, task.i0, task.i1, w->thread);
+        if(w->num_spans == w->max_spans) {
+            w->max_spans = w->max_spans ? w->max_spans * 2 : 16;
+            w->spans = (double*)realloc(w->spans, 
+                                        sizeof(double) * 2 * w->max_spans);
+            if(w->spans == NULL) {
+                err(5, "Could not allocate the timeline.");
+            }
+        }
+        w->spans[2 * w->num_spans] = t0;
+        w->spans[2 * w->num_spans + 1] = buddha_now() - p->start;
+        w->num_spans++;
+    }
+}
+
+
+void* buddha_pool_thread(void* arg) {
+    buddha_worker* w = (buddha_worker*)arg;
+    buddha_pool* p = w->pool;
+    int seen = 0;
+    buddha_pin(p->b, w->thread);
+    for(;;) {
+        pthread_mutex_lock(&p->lock);
+        while(p->generation == seen && !p->quit) {
+            pthread_cond_wait(&p->wake, &p->lock);
+        }
+        if(p->quit) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        seen = p->generation;
+        pthread_mutex_unlock(&p->lock);
+
+        buddha_worker_run(w);
+
+        pthread_mutex_lock(&p->lock);
+        if(--p->running == 0) {
+            pthread_cond_signal(&p->done);
+        }
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+
+/**
+ * Starts the thread pool, with b->threads workers counting the calling 
+ * thread. 
+ */
+void buddha_start_pool(buddha* b) {
+    buddha_pool* p = (buddha_pool*)calloc(1, sizeof(buddha_pool));
+    int t;
+    if(p == NULL) {
+        err(5, "Could not allocate the thread pool.");
+    }
+    p->b = b;
+    p->workers = (buddha_worker*)calloc(b->threads, sizeof(buddha_worker));
+    p->ids = (pthread_t*)malloc(sizeof(pthread_t) * b->threads);
+    if(p->workers == NULL || p->ids == NULL) {
+        err(5, "Could not allocate the thread pool.");
+    }
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->wake, NULL);
+    pthread_cond_init(&p->done, NULL);
+    b->pool = p;
+
+    for(t = 0; t < b->threads; t++) {
+        buddha_worker* w = &p->workers[t];
+        w->pool = p;
+        w->thread = t;
+        w->tasks = (buddha_task*)malloc(
+            sizeof(buddha_task) * TASKS_PER_THREAD);
+        if(w->tasks == NULL) {
+            err(5, "Could not allocate the thread pool.");
+        }
+        pthread_mutex_init(&w->lock, NULL);
+    }
+    buddha_pin(b, 0);
+    for(t = 1; t < b->threads; t++) {
+        if(pthread_create(&p->ids[t], NULL, &buddha_pool_thread, 
+                          &p->workers[t])) {
+            err(4, "Could not create worker thread.");
+        }
+    }
+}
+
+
+/**
+ * Stops the thread pool's threads and frees it. 
+ */
+void buddha_stop_pool(buddha* b) {
+    buddha_pool* p = b->pool;
+    int t;
+    if(p == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&p->lock);
+    p->quit = 1;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+    for(t = 1; t < b->threads; t++) {
+        pthread_join(p->ids[t], NULL);
+    }
+    for(t = 0; t < b->threads; t++) {
+        pthread_mutex_destroy(&p->workers[t].lock);
+        free(p->workers[t].tasks);
+        free(p->workers[t].spans);
+    }
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->wake);
+    pthread_cond_destroy(&p->done);
+    free(p->workers);
+    free(p->ids);
+    free(p);
+    b->pool = NULL;
+}
+
+
+/**
+ * Prints a line for each worker showing when it was busy (#) and idle (-) 
+ * over a pass that took the given time, its share of time busy, and how 
+ * many tasks it ran, stole, and the longest of them took. 
+ */
+void buddha_print_timeline(buddha* b, const char* name, double elapsed) {
+    int t, i, c;
+    printf("Timeline of %s pass (%.3fs):\n", name, elapsed);
+    for(t = 0; t < b->threads; t++) {
+        buddha_worker* w = &b->pool->workers[t];
+        double busy = 0, longest = 0;
+        char bar[TIMELINE_WIDTH + 1];
+        for(c = 0; c < TIMELINE_WIDTH; c++) {
+            double lo = elapsed * c / TIMELINE_WIDTH;
+            double hi = elapsed * (c + 1) / TIMELINE_WIDTH;
+            double in = 0;
+            for(i = 0; i < w->num_spans; i++) {
+                double s = fmax(lo, w->spans[2*i]);
+                double e = fmin(hi, w->spans[2*i + 1]);
+                in += e > s ? e - s : 0;
+            }
+            bar[c] = in * 2 >= hi - lo ? '#' : '-';
+        }
+        bar[TIMELINE_WIDTH] = '\0';
+        for(i = 0; i < w->num_spans; i++) {
+            double d = w->spans[2*i + 1] - w->spans[2*i];
+            busy += d;
+            longest = d > longest ? d : longest;
+        }
+        printf("  %3d |%s| %5.1f%% busy, %d tasks (%d stolen), "
+               "longest %.3fs\n", t, bar, 
+               elapsed > 0 ? busy / elapsed * 100 : 100, 
+               w->num_spans, w->steals, longest);
+    }
+}
+
+
+/**
+ * Calls fn(b, i0, i1, thread) for runs of the units 0 through count - 1 
+ * on the thread pool, starting it if need be. Each unit is processed 
+ * exactly once. The units are cut into up to TASKS_PER_THREAD tasks per 
+ * worker, and each worker is dealt a contiguous share of them, so that 
+ * neighboring units tend to stay on one thread until the work runs out 
+ * and stealing begins. The name of the pass is used for its timeline, if
+ * those are printed. 
+ */
+void buddha_parallel(buddha* b, const char* name, int count, 
+                     void (*fn)(buddha*, int, int, int)) {
+    int t, k, tasks = b->threads * TASKS_PER_THREAD;
+    if(count <= 0) {
+        return;
+    }
+    if(b->pool == NULL) {
+        buddha_start_pool(b);
+    }
+    buddha_pool* p = b->pool;
+    if(tasks > count) {
+        tasks = count;
+    }
+    for(t = 0; t < b->threads; t++) {
+        buddha_worker* w = &p->workers[t];
+        int k0 = (int)((long long)tasks * t / b->threads);
+        int k1 = (int)((long long)tasks * (t + 1) / b->threads);
+        w->head = w->tail = 0;
+        for(k = k0; k < k1; k++) {
+            w->tasks[w->tail].i0 = (int)((long long)count * k / tasks);
+            w->tasks[w->tail].i1 = (int)((long long)count * (k + 1) / tasks);
+            w->tail++;
+        }
+        w->num_spans = 0;
+        w->steals = 0;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->fn = fn;
+    p->start = buddha_now();
+    p->running = b->threads - 1;
+    p->generation++;
+    pthread_cond_broadcast(&p->wake);
+    pthread_mutex_unlock(&p->lock);
+
+    buddha_worker_run(&p->workers[0]);
+
+    pthread_mutex_lock(&p->lock);
+    while(p->running > 0) {
+        pthread_cond_wait(&p->done, &p->lock);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    if(b->timeline) {
+        buddha_print_timeline(b, name, buddha_now() - p->start);
+    }
+}
+
+
+/**
+ * A tile of the image: the pixels x0 <= x < x1 of the rows y0 <= y < y1. 
+ */
+typedef struct _buddha_tile {
+    int x0, y0, x1, y1;
+} buddha_tile;
+
+
+/**
+ * Returns the number of tiles across the image. 
+ */
+static inline int buddha_tiles_across(buddha* b) {
+    return (b->width + TILE_WIDTH - 1) / TILE_WIDTH;
+}
+
+
+/**
+ * Finds tile i of the image. The tiles are numbered in row-major order, 
+ * so a run of them covers a band of the image from left to right. 
+ */
+static inline void buddha_get_tile(buddha* b, int i, buddha_tile* t) {
+    int across = buddha_tiles_across(b);
+    t->x0 = i % across * TILE_WIDTH;
+    t->y0 = i / across * TILE_HEIGHT;
+    t->x1 = t->x0 + TILE_WIDTH < b->width ? t->x0 + TILE_WIDTH : b->width;
+    t->y1 = t->y0 + TILE_HEIGHT < b->height ? t->y0 + TILE_HEIGHT : b->height;
+}
+
+
+/**
+ * Calls fn(b, t0, t1, thread) for runs of tiles covering the image. A pass
+ * over the image's pixels visits those of tile t0, row by row, then those 
+ * of each following tile in turn. 
+ */
+void buddha_parallel_tiles(buddha* b, const char* name, 
+                           void (*fn)(buddha*, int, int, int)) {
+    int down = (b->height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    buddha_parallel(b, name, buddha_tiles_across(b) * down, fn);
+}
+
+
+/**
+ * Allocates the per-thread state for a run. Histograms are allocated 
+ * separately by the plot pass. 
+ */
+void buddha_alloc_locals(buddha* b) {
+    int t;
+    b->locals = (buddha_local*)calloc(b->threads, sizeof(buddha_local));
+    for(t = 0; t < b->threads; t++) {
+        buddha_local* l = &b->locals[t];
+        l->weight = 1;
+        l->queue_cr = (double*)malloc(sizeof(double) * QUEUE_SIZE * 2);
+        l->queue_ci = l->queue_cr + QUEUE_SIZE;
+        l->queue_its = (int*)malloc(sizeof(int) * QUEUE_SIZE);
+        l->queue_offs = (size_t*)malloc(sizeof(size_t) * QUEUE_SIZE);
+        if(l->queue_cr == NULL || l->queue_its == NULL || 
+           l->queue_offs == NULL) {
+            err(5, "Could not allocate per-thread buffers.");
+        }
+    }
+}
+
+
+/**
+ * Sizes the threads' orbit buffers to hold orbits of up to len points, or 
+ * orbit_limit if that is less. 
+ */
+void buddha_size_orbits(buddha* b, int len) {
+    int t;
+    if(len > b->orbit_limit) {
+        len = b->orbit_limit;
+    }
+    if(len < 1) {
+        len = 1;
+    }
+    for(t = 0; t < b->threads; t++) {
+        buddha_local* l = &b->locals[t];
+        free(l->orbit_re);
+        l->orbit_len = len;
+        l->orbit_re = (double*)malloc(sizeof(double) * len * b->lanes * 2);
+        l->orbit_im = l->orbit_re + len * b->lanes;
+        if(l->orbit_re == NULL) {
+            err(5, "Could not allocate per-thread buffers.");
+        }
+    }
+}
+
+
+void buddha_free_locals(buddha* b) {
+    int t;
+    for(t = 0; t < b->threads; t++) {
+        free(b->locals[t].orbit_re);
+        free(b->locals[t].queue_cr);
+        free(b->locals[t].queue_its);
+        free(b->locals[t].queue_offs);
+    }
+    free(b->locals);
+    b->locals = NULL;
+}
+
+
+/**
+ * Adds up the counters kept by each thread during a pass. The lane counts 
+ * go into the given total. The rejections, cycles, Metropolis proposals 
+ * and acceptances, and pixels filled by subdivision (and those found 
+ * wrong) go into the structure's. The threads' counters are reset for the 
+ * next pass. 
+ */
+void buddha_collect_counts(buddha* b, buddha_lanes* total) {
+    int t, i;
+    for(t = 0; t < b->threads; t++) {
+        buddha_local* l = &b->locals[t];
+        total->slots += l->lanes.slots;
+        total->busy += l->lanes.busy;
+        for(i = 0; i < 3; i++) {
+            b->rejected[i] += l->rejected[i];
+        }
+        b->cycles_found += l->cycles;
+        b->cycles_saved += l->cycles_saved;
+        b->mh_proposed += l->proposed;
+        b->mh_accepted += l->accepted;
+        b->filled += l->filled;
+        b->fill_errors += l->fill_errors;
+        memset(&l->lanes, 0, sizeof(buddha_lanes));
+        memset(l->rejected, 0, sizeof(l->rejected));
+        l->cycles = l->cycles_saved = 0;
+        l->proposed = l->accepted = 0;
+        l->filled = l->fill_errors = 0;
+    }
+}
+
+
+/**
+ * Tells how a row is handled in symmetric mode: 1 if the row is iterated 
+ * and its orbits are also plotted as their mirror images, -1 if it is 
+ * the mirror image of one of those and is skipped, and 0 if it has no 
+ * mirror image in the image (or it is its own) and is iterated as usual. 
+ */
+int buddha_row_symmetry(buddha* b, int y) {
+    int m = b->height - y;
+    if(!b->symmetric || m >= b->height || m == y) {
+        return 0;
+    }
+    return cimag(px2cx(b, 0, y)) > 0 ? 1 : -1;
+}
+
+
+/**
+ * Checks that each row's conjugate row, if there is one, has exactly the 
+ * opposite imaginary part. If not, iterating half of the rows wouldn't 
+ * give the same picture as iterating all of them. 
+ */
+int buddha_is_symmetric(buddha* b) {
+    int y;
+    for(y = 1; y < b->height; y++) {
+        if(cimag(px2cx(b, 0, y)) != -cimag(px2cx(b, 0, b->height - y))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+/**
+ * Returns the escape time of the point at the given offset in the escapes 
+ * map, 0 if it doesn't escape, or ESCAPE_FILLED or ESCAPE_UNKNOWN during 
+ * subdivision. A one-bit map gives 1 for every point that escapes. 
+ */
+static inline int buddha_escape(buddha* b, size_t offs) {
+    if(b->escape_width == ESCAPE_16) {
+        int its = ((unsigned short*)b->escapes)[offs];
+        return its > ESCAPE_16_MAX ? its - 0x10000 : its;
+    }
+    if(b->escape_width == ESCAPE_32) {
+        return ((int*)b->escapes)[offs];
+    }
+    return (((unsigned long long*)b->escapes)[offs >> 6] >> (offs & 63)) & 1;
+}
+
+
+/**
+ * Sets the escape time of the point at the given offset. A one-bit map is 
+ * updated atomically, as neighboring rows can share a word. 
+ */
+static inline void buddha_set_escape(buddha* b, size_t offs, int its) {
+    if(b->escape_width == ESCAPE_16) {
+        ((unsigned short*)b->escapes)[offs] = (unsigned short)its;
+    } else if(b->escape_width == ESCAPE_32) {
+        ((int*)b->escapes)[offs] = its;
+    } else {
+        atomic_ullong* word = (atomic_ullong*)b->escapes + (offs >> 6);
+        unsigned long long bit = 1ULL << (offs & 63);
+        if(its != 0) {
+            atomic_fetch_or_explicit(word, bit, memory_order_relaxed);
+        } else {
+            atomic_fetch_and_explicit(word, ~bit, memory_order_relaxed);
+        }
+    }
+}
+
+
+/**
+ * Runs the queued points through the kernel and records in the escapes 
+ * map when each of them escaped. 
+ */
+void buddha_calc_escapes_queue(buddha* b, buddha_local* l, int n) {
+    int j;
+    b->kernel(b, l, l->queue_cr, l->queue_ci, n, l->queue_its);
+    for(j = 0; j < n; j++) {
+        int its = l->queue_its[j];
+        if(its != b->iterations) {
+            buddha_set_escape(b, l->queue_offs[j], its);
+            l->longest = its > l->longest ? its : l->longest;
+        } else {
+            buddha_set_escape(b, l->queue_offs[j], 0);
+        }
+    }
+}
+
+
+/**
+ * Adds the pixels x0 <= x < x1 of row y to the n points already queued 
+ * for the escape pass, running the queue through the kernel whenever it 
+ * fills, and returns the number left in it. Points that buddha_reject 
+ * already knows to be in the set are left out, as are rows skipped in 
+ * symmetric mode. 
+ */
+int buddha_calc_escapes_run(buddha* b, buddha_local* l, int y, 
+                            int x0, int x1, int n) {
+    int x;
+    if(buddha_row_symmetry(b, y) < 0) {
+        return n;
+    }
+    for(x = x0; x < x1; x++) {
+        size_t offs = (size_t)y * b->width + x;
+        complex double c = px2cx(b, x, y);
+        if(buddha_reject(b, l, creal(c), cimag(c))) {
+            buddha_set_escape(b, offs, 0);
+            continue;
+        }
+        l->queue_cr[n] = creal(c);
+        l->queue_ci[n] = cimag(c);
+        l->queue_offs[n] = offs;
+        if(++n == QUEUE_SIZE) {
+            buddha_calc_escapes_queue(b, l, n);
+            n = 0;
+        }
+    }
+    return n;
+}
+
+
+/**
+ * Computes the escapes map for rows y0 through y1 - 1. 
+ */
+void buddha_calc_escapes_rows(buddha* b, int y0, int y1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    int y, n = 0;
+    for(y = y0; y < y1; y++) {
+        n = buddha_calc_escapes_run(b, l, y, 0, b->width, n);
+    }
+    if(n > 0) {
+        buddha_calc_escapes_queue(b, l, n);
+    }
+}
+
+
+/**
+ * Computes the escapes map for tiles t0 through t1 - 1. The queue is only 
+ * run once it fills, or at the end, rather than after every tile. 
+ */
+void buddha_calc_escapes_tiles(buddha* b, int t0, int t1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    int i, y, n = 0;
+    for(i = t0; i < t1; i++) {
+        buddha_tile t;
+        buddha_get_tile(b, i, &t);
+        for(y = t.y0; y < t.y1; y++) {
+            n = buddha_calc_escapes_run(b, l, y, t.x0, t.x1, n);
+        }
+    }
+    if(n > 0) {
+        buddha_calc_escapes_queue(b, l, n);
+    }
+}
+
+
+/**
+ * Computes the escapes map for the pixels of the rectangle x0 <= x < x1, 
+ * y0 <= y < y1 that aren't known yet, either all of them or only those 
+ * on its border. 
+ */
+void buddha_escape_rect(buddha* b, buddha_local* l, int x0, int y0, 
+                        int x1, int y1, int border) {
+    int x, y, n = 0;
+    for(y = y0; y < y1; y++) {
+        // The middle rows of the border are just their two ends, which are
+        // one and the same pixel in a rectangle one pixel wide. 
+        int edge = border && y != y0 && y != y1 - 1 && x1 - x0 > 1;
+        for(x = x0; x < x1; x += edge ? x1 - x0 - 1 : 1) {
+            size_t offs = (size_t)y * b->width + x;
+            if(buddha_escape(b, offs) != ESCAPE_UNKNOWN) {
+                continue;
+            }
+            complex double c = px2cx(b, x, y);
+            if(buddha_reject(b, l, creal(c), cimag(c))) {
+                buddha_set_escape(b, offs, 0);
+                continue;
+            }
+            l->queue_cr[n] = creal(c);
+            l->queue_ci[n] = cimag(c);
+            l->queue_offs[n] = offs;
+            if(++n == QUEUE_SIZE) {
+                buddha_calc_escapes_queue(b, l, n);
+                n = 0;
+            }
+        }
+    }
+    if(n > 0) {
+        buddha_calc_escapes_queue(b, l, n);
+    }
+}
+
+
+/**
+ * Computes the escapes map for a rectangle by Mariani-Silver subdivision. 
+ * Its border is iterated first, and if none of it escapes, the inside is 
+ * marked as filled without iterating it: as the Mandelbrot set is 
+ * connected, any part of its complement inside the rectangle would have 
+ * to reach the border. Otherwise the rectangle is split in four, until 
+ * the pieces are small enough to just iterate. 
+ *
+ * That argument only holds for the true set, and a pixel's center might 
+ * miss a thin filament of the complement, so the fill can be wrong. The 
+ * filled pixels are marked ESCAPE_FILLED so buddha_fill_tiles can check 
+ * them. 
+ */
+void buddha_subdivide(buddha* b, buddha_local* l, int x0, int y0, 
+                      int x1, int y1) {
+    int x, y;
+    buddha_escape_rect(b, l, x0, y0, x1, y1, 1);
+
+    int solid = 1;
+    for(x = x0; x < x1 && solid; x++) {
+        solid = !buddha_escape(b, (size_t)y0 * b->width + x) && 
+            !buddha_escape(b, (size_t)(y1 - 1) * b->width + x);
+    }
+    for(y = y0; y < y1 && solid; y++) {
+        solid = !buddha_escape(b, (size_t)y * b->width + x0) && 
+            !buddha_escape(b, (size_t)y * b->width + x1 - 1);
+    }
+    if(solid) {
+        for(y = y0 + 1; y < y1 - 1; y++) {
+            for(x = x0 + 1; x < x1 - 1; x++) {
+                size_t offs = (size_t)y * b->width + x;
+                if(buddha_escape(b, offs) == ESCAPE_UNKNOWN) {
+                    buddha_set_escape(b, offs, ESCAPE_FILLED);
+                    l->filled++;
+                }
+            }
+        }
+        return;
+    }
+
+    if(x1 - x0 <= SUBDIVIDE_MIN || y1 - y0 <= SUBDIVIDE_MIN) {
+        buddha_escape_rect(b, l, x0, y0, x1, y1, 0);
+        return;
+    }
+    int mx = (x0 + x1) / 2, my = (y0 + y1) / 2;
+    buddha_subdivide(b, l, x0, y0, mx, my);
+    buddha_subdivide(b, l, mx, y0, x1, my);
+    buddha_subdivide(b, l, x0, my, mx, y1);
+    buddha_subdivide(b, l, mx, my, x1, y1);
+}
+
+
+/**
+ * Computes the escapes map for tiles t0 through t1 - 1 by subdivision. 
+ * The tiles are SUBDIVIDE_TILE pixels square, and cover the rows from 
+ * b->subdivide_y0 down. 
+ */
+void buddha_subdivide_tiles(buddha* b, int t0, int t1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    int across = (b->width + SUBDIVIDE_TILE - 1) / SUBDIVIDE_TILE;
+    int t;
+    for(t = t0; t < t1; t++) {
+        int x0 = t % across * SUBDIVIDE_TILE;
+        int y0 = b->subdivide_y0 + t / across * SUBDIVIDE_TILE;
+        int x1 = x0 + SUBDIVIDE_TILE, y1 = y0 + SUBDIVIDE_TILE;
+        buddha_subdivide(b, l, x0, y0, 
+                         x1 < b->width ? x1 : b->width, 
+                         y1 < b->height ? y1 : b->height);
+    }
+}
+
+
+/**
+ * Runs the queued filled points through the kernel, and records which of 
+ * them escaped after all. 
+ */
+void buddha_verify_queue(buddha* b, buddha_local* l, int n) {
+    int j;
+    b->kernel(b, l, l->queue_cr, l->queue_ci, n, l->queue_its);
+    for(j = 0; j < n; j++) {
+        int its = l->queue_its[j];
+        if(its != b->iterations) {
+            buddha_set_escape(b, l->queue_offs[j], its);
+            l->longest = its > l->longest ? its : l->longest;
+            l->fill_errors++;
+        } else {
+            buddha_set_escape(b, l->queue_offs[j], 0);
+        }
+    }
+}
+
+
+/**
+ * Resolves the pixels filled by subdivision in tiles t0 through t1 - 1. 
+ * Normally they are just marked as not escaping. In verify mode they are 
+ * iterated after all, so that the map is exactly what buddha_calc_escapes 
+ * would compute without subdivision, and any that the fill got wrong are 
+ * counted. 
+ */
+void buddha_fill_tiles(buddha* b, int t0, int t1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    int i, x, y, n = 0;
+    for(i = t0; i < t1; i++) {
+        buddha_tile t;
+        buddha_get_tile(b, i, &t);
+        for(y = t.y0; y < t.y1; y++) {
+            for(x = t.x0; x < t.x1; x++) {
+                size_t offs = (size_t)y * b->width + x;
+                if(buddha_escape(b, offs) != ESCAPE_FILLED) {
+                    continue;
+                }
+                complex double c = px2cx(b, x, y);
+                if(!b->verify_fill || 
+                   buddha_reject(b, l, creal(c), cimag(c))) {
+                    buddha_set_escape(b, offs, 0);
+                    continue;
+                }
+                l->queue_cr[n] = creal(c);
+                l->queue_ci[n] = cimag(c);
+                l->queue_offs[n] = offs;
+                if(++n == QUEUE_SIZE) {
+                    buddha_verify_queue(b, l, n);
+                    n = 0;
+                }
+            }
+        }
+    }
+    if(n > 0) {
+        buddha_verify_queue(b, l, n);
+    }
+}
+
+
+/**
+ * Computes the escapes map by subdivision. Only the rows from the last one
+ * skipped in symmetric mode down are subdivided, so that no rectangle 
+ * straddles skipped rows; any rows above that which are iterated at all 
+ * (the first row, which has no mirror image) are done as usual. 
+ */
+void buddha_calc_escapes_subdivide(buddha* b) {
+    int y, tiles;
+    memset(b->escapes, 0xff, (size_t)b->width * b->height * 
+           (b->escape_width / 8));
+    for(y = b->height; y > 0 && buddha_row_symmetry(b, y - 1) >= 0; y--);
+    b->subdivide_y0 = y;
+    buddha_calc_escapes_rows(b, 0, y, 0);
+
+    tiles = (b->width + SUBDIVIDE_TILE - 1) / SUBDIVIDE_TILE * 
+        ((b->height - y + SUBDIVIDE_TILE - 1) / SUBDIVIDE_TILE);
+    buddha_parallel(b, "subdivision", tiles, &buddha_subdivide_tiles);
+    buddha_parallel_tiles(b, "fill", &buddha_fill_tiles);
+}
+
+
+/**
+ * Performs the first pass of rendering. This computes which points 
+ * in the image are not in the Mandelbrot set, and when those escape. In 
+ * symmetric mode the skipped rows are copied from their mirror images. 
+ *
+ * The longest escape time found sizes the orbit buffers for the plot 
+ * pass, so that every orbit fits and none need iterating a third time. 
+ */
+void buddha_calc_escapes(buddha* b) {
+    int x, y, t;
+    size_t size = (size_t)b->width * b->height;
+    if(b->escape_width == ESCAPE_BITS) {
+        b->escapes = calloc((size + 63) / 64, sizeof(unsigned long long));
+    } else {
+        b->escapes = malloc(size * (b->escape_width / 8));
+    }
+    if(b->escapes == NULL) {
+        err(5, "Could not allocate the escapes map.");
+    }
+    if(b->subdivide) {
+        buddha_calc_escapes_subdivide(b);
+    } else {
+        buddha_parallel_tiles(b, "escape", &buddha_calc_escapes_tiles);
+    }
+    buddha_collect_counts(b, &b->escape_lanes);
+
+    for(y = 0; y < b->height; y++) {
+        if(buddha_row_symmetry(b, y) < 0) {
+            for(x = 0; x < b->width; x++) {
+                buddha_set_escape(b, (size_t)y * b->width + x, 
+                    buddha_escape(b, (size_t)(b->height - y) * b->width + x));
+            }
+        }
+    }
+
+    for(t = 0; t < b->threads; t++) {
+        if(b->locals[t].longest > b->longest_escape) {
+            b->longest_escape = b->locals[t].longest;
+        }
+    }
+    if(b->escape_width != ESCAPE_BITS) {
+        buddha_size_orbits(b, b->longest_escape - 1);
+    }
+}
+
+
+/**
+ * Tells whether the orbit of a point with the given value in the escapes 
+ * map is plotted: it has to escape, and if the map holds escape times, 
+ * at a time in the band from min_orbit to max_orbit. 
+ */
+static inline int buddha_plots_escape(buddha* b, int its) {
+    return its != 0 && (b->escape_width == ESCAPE_BITS || 
+                        (its >= b->min_orbit && its <= b->max_orbit));
+}
+
+
+/**
+ * Adds the escaping points among the pixels x0 <= x < x1 of row y to the 
+ * n points already queued for the kernel, running the queue whenever it 
+ * fills, and returns the number left in it. Points that 
+ * buddha_plots_escape turns down are left out without iterating them. In 
+ * single-pass mode every point is queued, and the kernel drops the orbits
+ * of those that turn out not to escape. 
+ *
+ * In symmetric mode, rows that are mirror images are skipped, and the 
+ * queue is run whenever it switches between points that are plotted 
+ * with their mirror images and points that aren't. 
+ */
+int buddha_plot_escapes_run(buddha* b, buddha_local* l, int y, 
+                            int x0, int x1, int n) {
+    int x, mirror = buddha_row_symmetry(b, y);
+    if(mirror < 0) {
+        return n;
+    }
+    if(mirror != l->mirror && n > 0) {
+        b->kernel(b, l, l->queue_cr, l->queue_ci, n, NULL);
+        n = 0;
+    }
+    l->mirror = mirror;
+
+    for(x = x0; x < x1; x++) {
+        size_t offs = (size_t)y * b->width + x;
+        if(!b->single_pass && 
+           !buddha_plots_escape(b, buddha_escape(b, offs))) {
+            continue;
+        }
+        complex double c = px2cx(b, x, y);
+        if(b->single_pass && buddha_reject(b, l, creal(c), cimag(c))) {
+            continue;
+        }
+        l->queue_cr[n] = creal(c);
+        l->queue_ci[n] = cimag(c);
+        if(++n == QUEUE_SIZE) {
+            b->kernel(b, l, l->queue_cr, l->queue_ci, n, NULL);
+            n = 0;
+        }
+    }
+    return n;
+}
+
+
+/**
+ * Plots the escaping points among the pixels from offset p0 up to p1. 
+ */
+void buddha_plot_escapes_pixels(buddha* b, size_t p0, size_t p1, 
+                                int thread) {
+    buddha_local* l = &b->locals[thread];
+    int y, n = 0;
+    for(y = (int)(p0 / b->width); (size_t)y * b->width < p1; y++) {
+        size_t row = (size_t)y * b->width;
+        int x0 = row < p0 ? (int)(p0 - row) : 0;
+        int x1 = row + b->width > p1 ? (int)(p1 - row) : b->width;
+        n = buddha_plot_escapes_run(b, l, y, x0, x1, n);
+    }
+    if(n > 0) {
+        b->kernel(b, l, l->queue_cr, l->queue_ci, n, NULL);
+    }
+}
+
+
+/**
+ * Plots the escaping points in tiles t0 through t1 - 1. 
+ */
+void buddha_plot_escapes_tiles(buddha* b, int t0, int t1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    int i, y, n = 0;
+    for(i = t0; i < t1; i++) {
+        buddha_tile t;
+        buddha_get_tile(b, i, &t);
+        for(y = t.y0; y < t.y1; y++) {
+            n = buddha_plot_escapes_run(b, l, y, t.x0, t.x1, n);
+        }
+    }
+    if(n > 0) {
+        b->kernel(b, l, l->queue_cr, l->queue_ci, n, NULL);
+    }
+}
+
+
+/**
+ * Plots the escaping points in the plot pass's work units u0 through 
+ * u1 - 1, which cover a contiguous run of pixels. 
+ */
+void buddha_plot_escapes_units(buddha* b, int u0, int u1, int thread) {
+    buddha_plot_escapes_pixels(b, b->plot_cuts[u0], b->plot_cuts[u1], 
+                               thread);
+}
+
+
+/**
+ * Cuts the image into work units for the plot pass, of roughly equal cost
+ * going by the escape times in the map. Orbit lengths are very skewed, so 
+ * rows near the boundary of the set can cost more than the rest of the 
+ * image together; cutting by cost keeps any one unit from holding up the 
+ * end of the pass. Each point plotted is taken to cost its escape time, 
+ * and each one looked at one more. 
+ */
+void buddha_partition_plot(buddha* b) {
+    int units = b->threads * PLOT_UNITS_PER_THREAD;
+    size_t size = (size_t)b->width * b->height;
+    int x, y, u = 1;
+    long long total = 0, sum = 0;
+    b->plot_units = units;
+    b->plot_cuts = (size_t*)malloc(sizeof(size_t) * (units + 1));
+    if(b->plot_cuts == NULL) {
+        err(5, "Could not allocate the plot's work units.");
+    }
+
+    for(y = 0; y < b->height; y++) {
+        if(buddha_row_symmetry(b, y) < 0) {
+            continue;
+        }
+        for(x = 0; x < b->width; x++) {
+            int its = buddha_escape(b, (size_t)y * b->width + x);
+            total += 1 + (buddha_plots_escape(b, its) ? its : 0);
+        }
+    }
+
+    b->plot_cuts[0] = 0;
+    for(y = 0; y < b->height; y++) {
+        if(buddha_row_symmetry(b, y) < 0) {
+            continue;
+        }
+        for(x = 0; x < b->width; x++) {
+            int its = buddha_escape(b, (size_t)y * b->width + x);
+            sum += 1 + (buddha_plots_escape(b, its) ? its : 0);
+            while(u < units && sum * units >= total * u) {
+                b->plot_cuts[u++] = (size_t)y * b->width + x + 1;
+            }
+        }
+    }
+    while(u <= units) {
+        b->plot_cuts[u++] = size;
+    }
+}
+
+
+/**
+ * A counter-based random number generator (Philox4x32-10). Its output is a 
+ * pure function of a key, here the seed, and a counter made up of a 
+ * stream number, a work unit and a sample index within it. The numbers 
+ * for any sample can be regenerated on their own, without replaying any 
+ * that came before, so a render is bit-for-bit the same whatever the 
+ * number of threads and however the work units are scheduled. 
+ *
+ * Each block of output holds two doubles; further doubles for the same 
+ * sample come from bumping the last word of the counter. 
+ */
+typedef struct _buddha_rng {
+    unsigned int key[2];
+    unsigned int ctr[4];
+    unsigned int out[4];
+    int avail;
+} buddha_rng;
+
+
+// Streams of the generator, kept apart so that adding a use for random 
+// numbers doesn't change those drawn for another. 
+#define RNG_SAMPLE 0
+#define RNG_START 1
+#define RNG_MUTATE 2
+#define RNG_ROUND 3
+#define RNG_ROTATE 4
+#define RNG_HOT 5
+
+
+void philox4x32(const unsigned int ctr[4], const unsigned int key[2], 
+                unsigned int out[4]) {
+    unsigned int c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    unsigned int k0 = key[0], k1 = key[1];
+    int round;
+    for(round = 0; round < 10; round++) {
+        unsigned long long p0 = 0xD2511F53ULL * c0;
+        unsigned long long p1 = 0xCD9E8D57ULL * c2;
+        unsigned int n0 = (unsigned int)(p1 >> 32) ^ c1 ^ k0;
+        unsigned int n2 = (unsigned int)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (unsigned int)p1;
+        c3 = (unsigned int)p0;
+        c0 = n0;
+        c2 = n2;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    out[0] = c0;
+    out[1] = c1;
+    out[2] = c2;
+    out[3] = c3;
+}
+
+
+/**
+ * Positions the generator at the numbers for sample index in the given 
+ * work unit and stream. 
+ */
+void rng_seed(buddha_rng* r, unsigned long long seed, int stream, 
+              long long unit, long long index) {
+    r->key[0] = (unsigned int)seed;
+    r->key[1] = (unsigned int)(seed >> 32);
+    r->ctr[0] = (unsigned int)index;
+    r->ctr[1] = (unsigned int)unit;
+    r->ctr[2] = (unsigned int)(unit >> 32);
+    r->ctr[3] = (unsigned int)stream << 24;
+    r->avail = 0;
+}
+
+
+/**
+ * Returns a double uniformly distributed in [0, 1). 
+ */
+double rng_uniform(buddha_rng* r) {
+    if(r->avail == 0) {
+        philox4x32(r->ctr, r->key, r->out);
+        r->ctr[3]++;
+        r->avail = 4;
+    }
+    unsigned int* w = &r->out[4 - r->avail];
+    r->avail -= 2;
+    unsigned long long z = ((unsigned long long)w[0] << 32) | w[1];
+    return (z >> 11) * 0x1.0p-53;
+}
+
+
+/**
+ * Sets u and v to point i of the two-dimensional Sobol sequence. The first 
+ * coordinate is the bits of i reversed (the van der Corput sequence), and 
+ * the second the exclusive or of the direction numbers for the polynomial 
+ * x + 1 picked out by the bits of i. Each aligned block of 2^k points is 
+ * a (0, k, 2)-net: every box of area 2^-k with power-of-two sides holds 
+ * exactly one of them. 
+ */
+void sobol2(unsigned long long i, double* u, double* v) {
+    unsigned long long x = 0, y = 0, m = 1ULL << 63, d = m;
+    for(; i; i >>= 1, m >>= 1) {
+        if(i & 1) {
+            x ^= m;
+            y ^= d;
+        }
+        d ^= d >> 1;
+    }
+    *u = (double)(x >> 11) * 0x1.0p-53;
+    *v = (double)(y >> 11) * 0x1.0p-53;
+}
+
+
+/**
+ * Sets u and v to point i of the R2 sequence, an additive recurrence 
+ * based on the plastic number g, with steps 1/g and 1/g^2. 
+ */
+void r2(long long i, double* u, double* v) {
+    const double a1 = 0.7548776662466927, a2 = 0.5698402909980532;
+    *u = 0.5 + a1 * i;
+    *v = 0.5 + a2 * i;
+    *u -= floor(*u);
+    *v -= floor(*v);
+}
+
+
+/**
+ * Chooses sample i from the sample region. The shift, if not NULL, is added 
+ * to the points of the low-discrepancy sequences, wrapping around. 
+ */
+void buddha_sample(buddha* b, buddha_rng* r, long long i, 
+                   const double* shift, double* cr, double* ci) {
+    double w = b->region[2] - b->region[0], h = b->region[3] - b->sample_im0;
+    double u, v;
+    if(b->sampler == SAMPLER_SOBOL || b->sampler == SAMPLER_R2) {
+        if(b->sampler == SAMPLER_SOBOL) {
+            sobol2(i, &u, &v);
+        } else {
+            r2(i, &u, &v);
+        }
+        if(shift != NULL) {
+            u += shift[0];
+            v += shift[1];
+            u -= u >= 1;
+            v -= v >= 1;
+        }
+    } else {
+        u = rng_uniform(r);
+        v = rng_uniform(r);
+    }
+    if(b->sampler == SAMPLER_JITTER) {
+        u = (i % b->strata_x + u) / b->strata_x;
+        v = (i / b->strata_x + v) / b->strata_y;
+    }
+    *cr = b->region[0] + u * w;
+    *ci = b->sample_im0 + v * h;
+}
+
+
+/**
+ * Sets up the sample region and count before a run with one of the 
+ * samplers other than the grid. In symmetric mode, only the upper half 
+ * of a region that is symmetric about the real axis is sampled, with 
+ * half as many samples, and every orbit is also plotted mirrored. The 
+ * jittered sampler rounds the sample count up to fill its grid of cells. 
+ * The Metropolis sampler doesn't use symmetry. 
+ */
+void buddha_init_sampling(buddha* b) {
+    b->sample_im0 = b->region[1];
+    b->sample_mirror = 0;
+    if(b->sampler == SAMPLER_METROPOLIS) {
+        b->symmetric = 0;
+    }
+    if(b->symmetric && b->region[1] == -b->region[3]) {
+        b->sample_im0 = 0;
+        b->sample_mirror = 1;
+        b->samples = (b->samples + 1) / 2;
+    }
+    b->symmetric = b->sample_mirror;
+
+    if(b->sampler == SAMPLER_JITTER) {
+        double w = b->region[2] - b->region[0];
+        double h = b->region[3] - b->sample_im0;
+        b->strata_x = llround(sqrt(b->samples * w / h));
+        if(b->strata_x < 1) {
+            b->strata_x = 1;
+        }
+        b->strata_y = (b->samples + b->strata_x - 1) / b->strata_x;
+        b->samples = b->strata_x * b->strata_y;
+    }
+}
+
+
+/**
+ * Plots the samples in work units u0 through u1 - 1. Each unit is 
+ * SAMPLE_UNIT samples, apart from the last. As SAMPLE_UNIT is a power of 
+ * two, each unit of the Sobol sequence is a net on its own, and rotating 
+ * the units by different offsets keeps that while making every unit an 
+ * independent, unbiased estimate. 
+ */
+void buddha_plot_samples(buddha* b, int u0, int u1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    buddha_rng r;
+    double shift[2];
+    long long i, first;
+    int u, n = 0;
+    l->mirror = b->sample_mirror;
+    for(u = u0; u < u1; u++) {
+        long long hi = (long long)(u + 1) * SAMPLE_UNIT;
+        if(hi > b->samples) {
+            hi = b->samples;
+        }
+        rng_seed(&r, b->seed, RNG_ROTATE, u, 0);
+        shift[0] = rng_uniform(&r);
+        shift[1] = rng_uniform(&r);
+        first = (long long)u * SAMPLE_UNIT;
+        for(i = first; i < hi; i++) {
+            rng_seed(&r, b->seed, RNG_SAMPLE, u, i - first);
+            buddha_sample(b, &r, i, b->rotate ? shift : NULL, 
+                          &l->queue_cr[n], &l->queue_ci[n]);
+            if(buddha_reject(b, l, l->queue_cr[n], l->queue_ci[n])) {
+                continue;
+            }
+            if(++n == QUEUE_SIZE) {
+                b->kernel(b, l, l->queue_cr, l->queue_ci, n, NULL);
+                n = 0;
+            }
+        }
+    }
+    if(n > 0) {
+        b->kernel(b, l, l->queue_cr, l->queue_ci, n, NULL);
+    }
+}
+
+
+/**
+ * Finds the escape time at each corner of the boundary band map's cells, 
+ * for the rows of corners y0 through y1 - 1. 
+ */
+void buddha_band_rows(buddha* b, int y0, int y1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    double cw = (b->region[2] - b->region[0]) / b->band_gx;
+    double ch = (b->region[3] - b->sample_im0) / b->band_gy;
+    int x, y, j, n;
+    for(y = y0; y < y1; y++) {
+        int* its = &b->band_its[y * (b->band_gx + 1)];
+        for(x = 0, n = 0; x <= b->band_gx; x++) {
+            double cr = b->region[0] + x * cw, ci = b->sample_im0 + y * ch;
+            if(buddha_reject(b, l, cr, ci)) {
+                its[x] = b->iterations;
+                continue;
+            }
+            l->queue_cr[n] = cr;
+            l->queue_ci[n] = ci;
+            l->queue_offs[n] = x;
+            n++;
+        }
+        b->kernel(b, l, l->queue_cr, l->queue_ci, n, l->queue_its);
+        for(j = 0; j < n; j++) {
+            its[l->queue_offs[j]] = l->queue_its[j];
+        }
+    }
+}
+
+
+/**
+ * Builds the boundary band map for the band sampler. The sample region is 
+ * divided into cells about BAND_GRID across, and the points at their 
+ * corners are iterated. A cell is in the band if some of its corners 
+ * escape and some don't, or if they all escape but one takes at least 
+ * BAND_MIN_ITS iterations to. The band is then widened by band_dilate 
+ * cells on every side, to catch the thin filaments the corners miss. 
+ *
+ * The cells are listed in band_cells, the band_count cells of the band 
+ * first, and a sample is taken from the band with probability band_p, so 
+ * that the band is sampled band_boost times as densely as the rest. 
+ */
+void buddha_build_band(buddha* b) {
+    double w = b->region[2] - b->region[0];
+    double h = b->region[3] - b->sample_im0;
+    int gx = BAND_GRID, gy = (int)lround(BAND_GRID * h / w);
+    int x, y, dx, dy, n = 0, cells;
+    if(gy < 1) {
+        gy = 1;
+    }
+    cells = gx * gy;
+    b->band_gx = gx;
+    b->band_gy = gy;
+    b->band_its = (int*)malloc(sizeof(int) * (gx + 1) * (gy + 1));
+    b->band_cells = (int*)malloc(sizeof(int) * cells);
+    unsigned char* edge = (unsigned char*)calloc(cells, 1);
+    unsigned char* band = (unsigned char*)calloc(cells, 1);
+    if(b->band_its == NULL || b->band_cells == NULL || 
+       edge == NULL || band == NULL) {
+        err(5, "Could not allocate the boundary band map.");
+    }
+    buddha_parallel(b, "band map", gy + 1, &buddha_band_rows);
+    buddha_collect_counts(b, &b->escape_lanes);
+
+    for(y = 0; y < gy; y++) {
+        for(x = 0; x < gx; x++) {
+            int* its = &b->band_its[y * (gx + 1) + x];
+            int c[4] = { its[0], its[1], its[gx + 1], its[gx + 2] };
+            int i, inside = 0, longest = 0;
+            for(i = 0; i < 4; i++) {
+                if(c[i] == b->iterations) {
+                    inside++;
+                } else if(c[i] > longest) {
+                    longest = c[i];
+                }
+            }
+            edge[y * gx + x] = (inside > 0 && inside < 4) || 
+                (inside == 0 && longest >= BAND_MIN_ITS);
+        }
+    }
+
+    int d = b->band_dilate;
+    for(y = 0; y < gy; y++) {
+        for(x = 0; x < gx; x++) {
+            if(!edge[y * gx + x]) {
+                continue;
+            }
+            for(dy = y - d; dy <= y + d; dy++) {
+                for(dx = x - d; dx <= x + d; dx++) {
+                    if(dx >= 0 && dx < gx && dy >= 0 && dy < gy) {
+                        band[dy * gx + dx] = 1;
+                    }
+                }
+            }
+        }
+    }
+
+    for(x = 0; x < cells; x++) {
+        if(band[x]) {
+            b->band_cells[n++] = x;
+        }
+    }
+    b->band_count = n;
+    for(x = 0; x < cells; x++) {
+        if(!band[x]) {
+            b->band_cells[n++] = x;
+        }
+    }
+    b->band_p = (double)b->band_boost * b->band_count / 
+        ((double)b->band_boost * b->band_count + (cells - b->band_count));
+    free(edge);
+    free(band);
+    free(b->band_its);
+}
+
+
+/**
+ * Chooses a sample from the boundary band map: first whether it comes 
+ * from the band, then a cell, then a point in the cell, all uniformly. 
+ * Returns 1 if the point is in the band. 
+ */
+int buddha_band_sample(buddha* b, buddha_rng* r, double* cr, double* ci) {
+    int cells = b->band_gx * b->band_gy;
+    int in_band = rng_uniform(r) < b->band_p;
+    double u = rng_uniform(r);
+    int k = in_band ? 
+        b->band_cells[(int)(u * b->band_count)] : 
+        b->band_cells[b->band_count + (int)(u * (cells - b->band_count))];
+    double cw = (b->region[2] - b->region[0]) / b->band_gx;
+    double ch = (b->region[3] - b->sample_im0) / b->band_gy;
+    *cr = b->region[0] + (k % b->band_gx + rng_uniform(r)) * cw;
+    *ci = b->sample_im0 + (k / b->band_gx + rng_uniform(r)) * ch;
+    return in_band;
+}
+
+
+/**
+ * Plots the samples in work units u0 through u1 - 1 with the band sampler.
+ * Each unit is gone through twice, once plotting the samples that fall in
+ * the band, and once those outside of it, counting each of their orbit's
+ * points band_boost times to make up for them being sampled that much 
+ * more sparsely. 
+ */
+void buddha_plot_band(buddha* b, int u0, int u1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    buddha_rng r;
+    long long i, first;
+    int u, pass, n = 0;
+    l->mirror = b->sample_mirror;
+    for(u = u0; u < u1; u++) {
+        long long hi = (long long)(u + 1) * SAMPLE_UNIT;
+        if(hi > b->samples) {
+            hi = b->samples;
+        }
+        first = (long long)u * SAMPLE_UNIT;
+        for(pass = 1; pass >= 0; pass--) {
+            buddha_flush_bins(b, l);
+            l->weight = pass ? 1 : b->band_boost;
+            for(i = first; i < hi; i++) {
+                rng_seed(&r, b->seed, RNG_SAMPLE, u, i - first);
+                if(buddha_band_sample(b, &r, &l->queue_cr[n], 
+                                      &l->queue_ci[n]) != pass || 
+                   buddha_reject(b, l, l->queue_cr[n], l->queue_ci[n])) {
+                    continue;
+                }
+                if(++n == QUEUE_SIZE) {
+                    b->kernel(b, l, l->queue_cr, l->queue_ci, n, NULL);
+                    n = 0;
+                }
+            }
+            if(n > 0) {
+                b->kernel(b, l, l->queue_cr, l->queue_ci, n, NULL);
+                n = 0;
+            }
+        }
+    }
+    buddha_flush_bins(b, l);
+    l->weight = 1;
+}
+
+
+/**
+ * Iterates the point and returns the number of points of its orbit that 
+ * land in the view, or 0 if it doesn't escape, escapes outside the band 
+ * from min_orbit to max_orbit, or is outside the sample region. This is 
+ * the density the Metropolis sampler draws points from. 
+ */
+int buddha_orbit_weight(buddha* b, buddha_local* l, double cr, double ci) {
+    if(!(cr >= b->region[0] && cr < b->region[2] && 
+         ci >= b->region[1] && ci < b->region[3]) || 
+       buddha_reject(b, l, cr, ci)) {
+        return 0;
+    }
+    double zr = 0, zi = 0;
+    size_t p;
+    int i = 1, n = 0;
+    for(; i < b->iterations; i++) {
+        double t = zr*zr - zi*zi + cr;
+        zi = 2*zr*zi + ci;
+        zr = t;
+        if(zr*zr + zi*zi >= 4) {
+            return i >= b->min_orbit && i <= b->max_orbit ? n : 0;
+        }
+        n += buddha_pixel(b, CMPLX(zr, zi), &p);
+    }
+    return 0;
+}
+
+
+/**
+ * Plots the orbit of an escaping point, counting each of its points that 
+ * lands in the view with the given weight. As the histogram holds 
+ * integers, the fractional part of the weight is rounded up or down at 
+ * random, with a chance of rounding up equal to it, so that the expected 
+ * count is the weight itself. 
+ */
+void buddha_plot_weighted(buddha* b, buddha_local* l, double cr, double ci,
+                          double weight, buddha_rng* r) {
+    int whole = (int)weight;
+    double frac = weight - whole;
+    double zr = 0, zi = 0;
+    size_t p;
+    int i = 1;
+    for(; i < b->iterations; i++) {
+        double t = zr*zr - zi*zi + cr;
+        zi = 2*zr*zi + ci;
+        zr = t;
+        if(zr*zr + zi*zi >= 4) {
+            break;
+        }
+        if(buddha_pixel(b, CMPLX(zr, zi), &p)) {
+            buddha_add(b, l, p, whole + (rng_uniform(r) < frac));
+        }
+    }
+}
+
+
+/**
+ * The pilot run for the Metropolis sampler, over work units u0 through 
+ * u1 - 1 of SAMPLE_UNIT uniformly sampled points each. The sum of their 
+ * weights and the number with any weight go into mh_sums, and the first 
+ * point with any weight becomes the unit's starting point (or NAN if 
+ * there is none). 
+ */
+void buddha_pilot_units(buddha* b, int u0, int u1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    buddha_rng r;
+    long long i;
+    int u;
+    for(u = u0; u < u1; u++) {
+        double sum = 0, hits = 0, cr, ci;
+        double* start = &b->mh_starts[2*u];
+        start[0] = start[1] = NAN;
+        for(i = 0; i < SAMPLE_UNIT; i++) {
+            rng_seed(&r, b->seed, RNG_START, u, i);
+            buddha_sample(b, &r, i, NULL, &cr, &ci);
+            int w = buddha_orbit_weight(b, l, cr, ci);
+            if(w > 0 && isnan(start[0])) {
+                start[0] = cr;
+                start[1] = ci;
+            }
+            sum += w;
+            hits += w > 0;
+        }
+        b->mh_sums[2*u] = sum;
+        b->mh_sums[2*u + 1] = hits;
+    }
+}
+
+
+/**
+ * Runs the Metropolis chains c0 through c1 - 1. Each chain wanders over 
+ * the sample region, moving to a proposed point with probability 
+ * min(1, w'/w) where w and w' are the weights of the current and proposed 
+ * points, so that it visits points in proportion to their weight. The 
+ * proposals either jump anywhere in the region or take a step in a random
+ * direction, of a length between MH_STEP_MIN and MH_STEP_MAX of the view's
+ * width on a log scale. Both kinds are symmetric, so no correction for 
+ * them is needed. 
+ *
+ * Each step plots the chain's current point, with its orbit weighted by 
+ * mh_mean / w. That undoes the bias toward heavy orbits, so the expected 
+ * histogram is the same as with the random sampler taking as many samples 
+ * whose orbits reach the view as the chains take steps. 
+ * A point that the chain stays on for several steps is plotted once with
+ * the weight of all of them, when the chain moves on. 
+ */
+void buddha_metropolis_chains(buddha* b, int c0, int c1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    double span = b->re_max - b->re_min;
+    buddha_rng r, round;
+    int c;
+    for(c = c0; c < c1; c++) {
+        long long steps = b->samples - (long long)c * MH_CHAIN, step;
+        long long stay = 0;
+        if(steps > MH_CHAIN) {
+            steps = MH_CHAIN;
+        }
+        double* start = &b->mh_starts[2 * (c % b->mh_num_starts)];
+        double cr = start[0], ci = start[1];
+        int w = buddha_orbit_weight(b, l, cr, ci);
+
+        for(step = 0; step < MH_BURN_IN + steps; step++) {
+            double nr, ni;
+            rng_seed(&r, b->seed, RNG_MUTATE, c, step);
+            if(rng_uniform(&r) < MH_LARGE_STEP) {
+                buddha_sample(b, &r, step, NULL, &nr, &ni);
+            } else {
+                double len = span * MH_STEP_MAX * 
+                    exp(log(MH_STEP_MIN / MH_STEP_MAX) * rng_uniform(&r));
+                double a = 2 * M_PI * rng_uniform(&r);
+                nr = cr + len * cos(a);
+                ni = ci + len * sin(a);
+            }
+
+            int nw = buddha_orbit_weight(b, l, nr, ni);
+            l->proposed++;
+            if(nw > 0 && rng_uniform(&r) * w < nw) {
+                l->accepted++;
+                if(stay > 0) {
+                    rng_seed(&round, b->seed, RNG_ROUND, c, step);
+                    buddha_plot_weighted(b, l, cr, ci, 
+                                         stay * b->mh_mean / w, &round);
+                }
+                cr = nr;
+                ci = ni;
+                w = nw;
+                stay = 0;
+            }
+            if(step >= MH_BURN_IN) {
+                stay++;
+            }
+        }
+        if(stay > 0) {
+            rng_seed(&round, b->seed, RNG_ROUND, c, step);
+            buddha_plot_weighted(b, l, cr, ci, 
+                                 stay * b->mh_mean / w, &round);
+        }
+    }
+}
+
+
+/**
+ * Plots the samples with the Metropolis sampler, which spends its time on 
+ * the points whose orbits pass through the view. A pilot run of uniform 
+ * samples, an eighth as many as the chains will take, finds starting 
+ * points for the chains and the mean weight of an orbit. 
+ */
+void buddha_metropolis(buddha* b) {
+    int units = (int)(b->samples / 8 / SAMPLE_UNIT), u;
+    if(units < 1) {
+        units = 1;
+    }
+    b->mh_sums = (double*)malloc(sizeof(double) * units * 2);
+    b->mh_starts = (double*)malloc(sizeof(double) * units * 2);
+    if(b->mh_sums == NULL || b->mh_starts == NULL) {
+        err(5, "Could not allocate the pilot run.");
+    }
+    buddha_parallel(b, "pilot", units, &buddha_pilot_units);
+
+    // The sums and starting points are gathered in order, so that the 
+    // result doesn't depend on which thread ran which unit. 
+    double sum = 0, hits = 0;
+    b->mh_num_starts = 0;
+    for(u = 0; u < units; u++) {
+        sum += b->mh_sums[2*u];
+        hits += b->mh_sums[2*u + 1];
+        if(!isnan(b->mh_starts[2*u])) {
+            b->mh_starts[2 * b->mh_num_starts] = b->mh_starts[2*u];
+            b->mh_starts[2 * b->mh_num_starts + 1] = b->mh_starts[2*u + 1];
+            b->mh_num_starts++;
+        }
+    }
+    if(b->mh_num_starts == 0) {
+        err(6, "No orbits pass through the view. Try more samples.");
+    }
+    b->mh_mean = sum / hits;
+
+    int chains = (int)((b->samples + MH_CHAIN - 1) / MH_CHAIN);
+    buddha_parallel(b, "plot", chains, &buddha_metropolis_chains);
+    free(b->mh_sums);
+    free(b->mh_starts);
+}
+
+
+/**
+ * Calls fn(b, c0, c1, thread) for runs of PLOT_CHUNK-counter chunks 
+ * covering the plot. This suits passes that treat every counter alike, 
+ * and don't need to know which pixel it belongs to. 
+ */
+void buddha_parallel_chunks(buddha* b, const char* name, 
+                            void (*fn)(buddha*, int, int, int)) {
+    buddha_parallel(b, name, 
+                    (int)((b->plot_size + PLOT_CHUNK - 1) / PLOT_CHUNK), fn);
+}
+
+
+/**
+ * Sums the per-thread histograms into the plot for chunks c0 through 
+ * c1 - 1, keeping track of the largest count seen. 
+ *
+ * The first thread's histogram is the plot itself, so only the others 
+ * need to be added in, unless the histogram is hybrid, in which case the 
+ * hot bins were already added by buddha_reduce_hot. Each chunk of the
+ * plot stays in cache while every histogram is added to it, rather than
+ * being read and written back once per thread. The loops run over
+ * contiguous runs of counters so that the compiler can vectorize them. 
+ * Int sums are done unsigned, with any that go past INT_MAX noted in the 
+ * thread's overflow bits. 
+ */
+void buddha_reduce_chunks(buddha* b, int c0, int c1, int thread) {
+    buddha_local* self = &b->locals[thread];
+    long long max = self->max;
+    unsigned int overflow = 0;
+    size_t i;
+    int c, t;
+    for(c = c0; c < c1; c++) {
+        size_t lo = (size_t)c * PLOT_CHUNK, hi = lo + PLOT_CHUNK;
+        if(hi > b->plot_size) {
+            hi = b->plot_size;
+        }
+        for(t = 1; t < b->threads && b->compact; t++) {
+            buddha_local* l = &b->locals[t];
+            for(i = lo; i < hi; i++) {
+                // A sum under COMPACT_MAX means neither counter spilled. 
+                int sum = b->cells[i] + l->cells[i];
+                if(sum < COMPACT_MAX) {
+                    b->cells[i] = (unsigned short)sum;
+                } else {
+                    buddha_add_compact(b->cells, &b->spill, i, 
+                        buddha_get_compact(l->cells, l->spill, i));
+                }
+            }
+        }
+        for(t = 1; t < b->threads && b->wide && !b->hot_slots; t++) {
+            long long* src = b->locals[t].plot64;
+            for(i = lo; i < hi; i++) {
+                b->plot64[i] += src[i];
+            }
+        }
+        for(t = 1; t < b->threads && b->plot && !b->hot_slots; t++) {
+            unsigned int* dst = (unsigned int*)b->plot;
+            unsigned int* src = (unsigned int*)b->locals[t].plot;
+            for(i = lo; i < hi; i++) {
+                dst[i] += src[i];
+                overflow |= dst[i];
+            }
+        }
+        for(i = lo; i < hi; i++) {
+            long long n = buddha_count(b, i);
+            max = n > max ? n : max;
+        }
+    }
+    self->max = max;
+    self->overflow |= overflow;
+}
+
+
+/**
+ * Runs the queued points of the hot bin pilot through the kernel, and 
+ * counts the orbit points of those that escape by the bin they land in. 
+ */
+void buddha_hot_queue(buddha* b, buddha_local* l, int n) {
+    int i, j;
+    size_t p;
+    b->kernel(b, l, l->queue_cr, l->queue_ci, n, l->queue_its);
+    for(j = 0; j < n; j++) {
+        double cr = l->queue_cr[j], ci = l->queue_ci[j], zr = 0, zi = 0;
+        if(l->queue_its[j] == b->iterations) {
+            continue;
+        }
+        for(i = 1; i < l->queue_its[j]; i++) {
+            double t = zr*zr - zi*zi + cr;
+            zi = 2*zr*zi + ci;
+            zr = t;
+            if(buddha_pixel(b, CMPLX(zr, zi), &p)) {
+                l->hot_hits[p >> BIN_SHIFT]++;
+            }
+            if(b->symmetric && buddha_pixel(b, CMPLX(zr, -zi), &p)) {
+                l->hot_hits[p >> BIN_SHIFT]++;
+            }
+        }
+    }
+}
+
+
+/**
+ * The pilot run for a hybrid histogram, over work units u0 through u1 - 1
+ * of SAMPLE_UNIT points each, drawn uniformly from the view for the grid 
+ * or from the sample region otherwise. It counts how often each bin of 
+ * the histogram is hit, to find those worth a private copy. The pilot's 
+ * work is left out of the stats. 
+ */
+void buddha_hot_pilot(buddha* b, int u0, int u1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    double view[4] = { b->re_min, b->im_min, b->re_max, b->im_max };
+    const double* box = b->sampler == SAMPLER_GRID ? view : b->region;
+    buddha_lanes lanes = l->lanes;
+    long long rejected[3], cycles = l->cycles, saved = l->cycles_saved;
+    buddha_rng r;
+    int u, i, n = 0;
+    memcpy(rejected, l->rejected, sizeof(rejected));
+    for(u = u0; u < u1; u++) {
+        for(i = 0; i < SAMPLE_UNIT; i++) {
+            rng_seed(&r, b->seed, RNG_HOT, u, i);
+            l->queue_cr[n] = box[0] + rng_uniform(&r) * (box[2] - box[0]);
+            l->queue_ci[n] = box[1] + rng_uniform(&r) * (box[3] - box[1]);
+            if(buddha_reject(b, l, l->queue_cr[n], l->queue_ci[n])) {
+                continue;
+            }
+            if(++n == QUEUE_SIZE) {
+                buddha_hot_queue(b, l, n);
+                n = 0;
+            }
+        }
+    }
+    if(n > 0) {
+        buddha_hot_queue(b, l, n);
+    }
+    l->lanes = lanes;
+    memcpy(l->rejected, rejected, sizeof(rejected));
+    l->cycles = cycles;
+    l->cycles_saved = saved;
+}
+
+
+int buddha_compare_hits(const void* a, const void* b) {
+    const long long* x = (const long long*)a;
+    const long long* y = (const long long*)b;
+    if(x[0] != y[0]) {
+        return x[0] > y[0] ? -1 : 1;
+    }
+    return x[1] < y[1] ? -1 : x[1] > y[1];
+}
+
+
+/**
+ * Sets up a hybrid histogram: a pilot run finds the hot_bins bins that are
+ * hit most often, and each thread gets a private copy of just those. All 
+ * other counts go straight into the shared plot, with relaxed atomic adds.
+ * The memory used grows with the number of hot bins rather than with the 
+ * image, while the bins where threads would contend the most are private.
+ * Bins the pilot never hit aren't made hot. 
+ */
+void buddha_choose_hot(buddha* b) {
+    long long* order = (long long*)calloc(2 * b->num_bins, sizeof(long long));
+    int t, k;
+    b->hot_slots = (int*)malloc(sizeof(int) * b->num_bins);
+    b->hot_list = (int*)malloc(sizeof(int) * b->num_bins);
+    if(order == NULL || b->hot_slots == NULL || b->hot_list == NULL) {
+        err(5, "Could not allocate the hot bins.");
+    }
+    for(t = 0; t < b->threads; t++) {
+        b->locals[t].hot_hits = (long long*)calloc(b->num_bins, 
+                                                   sizeof(long long));
+        if(b->locals[t].hot_hits == NULL) {
+            err(5, "Could not allocate the hot bins.");
+        }
+    }
+    buddha_parallel(b, "hot pilot", HOT_PILOT_UNITS, &buddha_hot_pilot);
+
+    for(k = 0; k < b->num_bins; k++) {
+        order[2 * k + 1] = k;
+        for(t = 0; t < b->threads; t++) {
+            order[2 * k] += b->locals[t].hot_hits[k];
+        }
+        b->hot_slots[k] = -1;
+    }
+    qsort(order, b->num_bins, 2 * sizeof(long long), &buddha_compare_hits);
+    b->num_hot = 0;
+    while(b->num_hot < b->hot_bins && b->num_hot < b->num_bins && 
+          order[2 * b->num_hot] > 0) {
+        b->hot_list[b->num_hot] = (int)order[2 * b->num_hot + 1];
+        b->hot_slots[b->hot_list[b->num_hot]] = b->num_hot;
+        b->num_hot++;
+    }
+    free(order);
+
+    for(t = 0; t < b->threads; t++) {
+        buddha_local* l = &b->locals[t];
+        free(l->hot_hits);
+        l->hot_hits = NULL;
+        if(b->wide) {
+            l->hot64 = (long long*)calloc((size_t)b->num_hot << BIN_SHIFT, 
+                                          sizeof(long long));
+        } else {
+            l->hot = (int*)calloc((size_t)b->num_hot << BIN_SHIFT, 
+                                  sizeof(int));
+        }
+        if(l->hot == NULL && l->hot64 == NULL && b->num_hot > 0) {
+            err(5, "Could not allocate the hot bins.");
+        }
+    }
+}
+
+
+/**
+ * Adds the threads' copies of the bins in hot slots s0 through s1 - 1 to 
+ * the plot. 
+ */
+void buddha_reduce_hot(buddha* b, int s0, int s1, int thread) {
+    unsigned int overflow = 0;
+    int s, i, t;
+    for(s = s0; s < s1; s++) {
+        size_t lo = (size_t)b->hot_list[s] << BIN_SHIFT;
+        size_t from = (size_t)s << BIN_SHIFT;
+        int n = 1 << BIN_SHIFT;
+        if(lo + n > b->plot_size) {
+            n = (int)(b->plot_size - lo);
+        }
+        for(t = 0; t < b->threads && b->wide; t++) {
+            long long* src = b->locals[t].hot64 + from;
+            for(i = 0; i < n; i++) {
+                b->plot64[lo + i] += src[i];
+            }
+        }
+        for(t = 0; t < b->threads && !b->wide; t++) {
+            unsigned int* dst = (unsigned int*)b->plot + lo;
+            unsigned int* src = (unsigned int*)b->locals[t].hot + from;
+            for(i = 0; i < n; i++) {
+                dst[i] += src[i];
+                overflow |= dst[i];
+            }
+        }
+    }
+    b->locals[thread].overflow |= overflow;
+}
+
+
+/**
+ * Adds the increments still pending in the bins of threads t0 through 
+ * t1 - 1 to their histograms. 
+ */
+void buddha_flush_threads(buddha* b, int t0, int t1, int thread) {
+    int t;
+    for(t = t0; t < t1; t++) {
+        buddha_flush_bins(b, &b->locals[t]);
+    }
+}
+
+
+/**
+ * Performs a second iteration for each point in the image that is not 
+ * in the Mandelbrot set. At each iteration the value of z is counted
+ * into the thread's histogram using buddha_plot_callback. In single-pass 
+ * mode, or with a sampler other than the grid, this is the only 
+ * iteration, and buddha_calc_escapes is not used. 
+ *
+ * The per-thread counts are then summed into the plot, which also sets 
+ * the structure's max field. 
+ */
+void buddha_plot_escapes(buddha* b) {
+    size_t size = b->plot_size;
+    int t;
+    if(b->compact) {
+        memset(b->cells, 0, sizeof(unsigned short) * size);
+        b->locals[0].cells = b->cells;
+        b->locals[0].spill = &b->spill;
+    } else if(b->wide) {
+        memset(b->plot64, 0, sizeof(long long) * size);
+        b->locals[0].plot64 = b->plot64;
+    } else {
+        memset(b->plot, 0, sizeof(int) * size);
+        b->locals[0].plot = b->plot;
+    }
+    for(t = 1; t < b->threads && b->compact; t++) {
+        buddha_local* l = &b->locals[t];
+        l->cells = (unsigned short*)calloc(size, sizeof(unsigned short));
+        l->spill = (buddha_spill*)malloc(sizeof(buddha_spill));
+        if(l->cells == NULL || l->spill == NULL) {
+            err(5, "Could not allocate per-thread histogram.");
+        }
+        buddha_spill_init(l->spill);
+    }
+    for(t = 1; t < b->threads && b->wide && b->hot_bins == 0; t++) {
+        b->locals[t].plot64 = (long long*)calloc(size, sizeof(long long));
+        if(b->locals[t].plot64 == NULL) {
+            err(5, "Could not allocate per-thread histogram.");
+        }
+    }
+    for(t = 1; t < b->threads && b->plot && b->hot_bins == 0; t++) {
+        b->locals[t].plot = (int*)calloc(size, sizeof(int));
+        if(b->locals[t].plot == NULL) {
+            err(5, "Could not allocate per-thread histogram.");
+        }
+    }
+    for(t = 0; t < b->threads && b->binned; t++) {
+        buddha_local* l = &b->locals[t];
+        l->bins = (unsigned short*)malloc(sizeof(unsigned short) * 
+                                          BIN_SIZE * b->num_bins);
+        l->bin_fill = (int*)calloc(b->num_bins, sizeof(int));
+        if(l->bins == NULL || l->bin_fill == NULL) {
+            err(5, "Could not allocate per-thread bins.");
+        }
+    }
+    if(b->hot_bins > 0) {
+        buddha_choose_hot(b);
+    }
+
+    if(b->sampler == SAMPLER_GRID) {
+        if(b->single_pass || b->escape_width == ESCAPE_BITS) {
+            buddha_parallel_tiles(b, "plot", &buddha_plot_escapes_tiles);
+        } else {
+            buddha_partition_plot(b);
+            buddha_parallel(b, "plot", b->plot_units, 
+                            &buddha_plot_escapes_units);
+            free(b->plot_cuts);
+            b->plot_cuts = NULL;
+        }
+    } else if(b->sampler == SAMPLER_METROPOLIS) {
+        buddha_metropolis(b);
+    } else {
+        int units = (int)((b->samples + SAMPLE_UNIT - 1) / SAMPLE_UNIT);
+        if(b->sampler == SAMPLER_BAND) {
+            buddha_build_band(b);
+            buddha_parallel(b, "plot", units, &buddha_plot_band);
+        } else {
+            buddha_parallel(b, "plot", units, &buddha_plot_samples);
+        }
+    }
+    if(b->binned) {
+        buddha_parallel(b, "flush", b->threads, &buddha_flush_threads);
+    }
+    buddha_collect_counts(b, &b->plot_lanes);
+
+    for(t = 0; t < b->threads; t++) {
+        b->locals[t].max = 0;
+        free(b->locals[t].bins);
+        free(b->locals[t].bin_fill);
+        b->locals[t].bins = NULL;
+        b->locals[t].bin_fill = NULL;
+    }
+    if(b->hot_slots != NULL) {
+        buddha_parallel(b, "reduce hot", b->num_hot, &buddha_reduce_hot);
+    }
+    buddha_parallel_chunks(b, "reduce", &buddha_reduce_chunks);
+
+    b->max = 0;
+    for(t = 0; t < b->threads; t++) {
+        if(b->locals[t].max > b->max) {
+            b->max = b->locals[t].max;
+        }
+        if(b->locals[t].overflow > INT_MAX) {
+            err(7, "A histogram counter overflowed. Try --wide-counters.");
+        }
+        if(t > 0) {
+            free(b->locals[t].plot);
+            free(b->locals[t].plot64);
+            free(b->locals[t].cells);
+            if(b->locals[t].spill) {
+                buddha_spill_free(b->locals[t].spill);
+                free(b->locals[t].spill);
+            }
+        }
+        b->locals[t].plot = NULL;
+        b->locals[t].plot64 = NULL;
+        b->locals[t].cells = NULL;
+        b->locals[t].spill = NULL;
+        free(b->locals[t].hot);
+        free(b->locals[t].hot64);
+        b->locals[t].hot = NULL;
+        b->locals[t].hot64 = NULL;
+    }
+    free(b->hot_slots);
+    free(b->hot_list);
+    b->hot_slots = NULL;
+    b->hot_list = NULL;
+}
+
+
+/**
+ * Prints out overall stats and a text histogram of the plot counts. 
+ */
+void buddha_print_stats(buddha* b) {
+    printf("Iterations: %d\n", b->iterations);
+    printf("Dimensions: %dx%dpx\n", b->width, b->height);
+    printf("Kernel: %s\n", b->kernel_name);
+    printf("Symmetry: %s\n", b->symmetric ? "on" : "off");
+    if(b->sampler != SAMPLER_GRID) {
+        printf("Sampler: %s, %lld samples\n", 
+               sampler_names[b->sampler], b->samples);
+    }
+    if(b->band_cells) {
+        printf("Boundary band: %.2f%% of the region, sampled %dx as densely\n",
+               (double)b->band_count / (b->band_gx * b->band_gy) * 100, 
+               b->band_boost);
+    }
+    if(b->hot_bins > 0) {
+        size_t bin = (b->wide ? sizeof(long long) : sizeof(int)) << BIN_SHIFT;
+        printf("Hot bins: %d, %.1f MB per thread\n", b->num_hot, 
+               (double)b->num_hot * bin / (1 << 20));
+    }
+    if(b->mh_proposed) {
+        printf("Metropolis acceptance: %.2f%% (%d chains)\n", 
+               (double)b->mh_accepted / b->mh_proposed * 100, 
+               (int)((b->samples + MH_CHAIN - 1) / MH_CHAIN));
+    }
+    if(b->escapes) {
+        printf("Escape map: %s, longest escape %d\n", 
+               b->escape_width == ESCAPE_BITS ? "1-bit" : 
+               b->escape_width == ESCAPE_16 ? "16-bit" : "32-bit", 
+               b->longest_escape);
+    }
+    if(b->subdivide && b->escapes) {
+        printf("Subdivision filled: %lld pixels (%.2f%%)", b->filled, 
+               (double)b->filled / b->width / b->height * 100);
+        if(b->verify_fill) {
+            printf(", %lld wrong and corrected", b->fill_errors);
+        }
+        printf("\n");
+    }
+    if(b->escape_lanes.slots) {
+        printf("Escape pass lane utilization: %.2f%%\n", 
+               (double)b->escape_lanes.busy / b->escape_lanes.slots * 100);
+    }
+    if(b->plot_lanes.slots) {
+        printf("Plot pass lane utilization: %.2f%%\n", 
+               (double)b->plot_lanes.busy / b->plot_lanes.slots * 100);
+    }
+    if(b->reject) {
+        printf("Rejected in main cardioid: %lld\n", b->rejected[0]);
+        printf("Rejected in period-2 bulb: %lld\n", b->rejected[1]);
+    }
+    if(b->reject && b->bulb_table) {
+        printf("Rejected in bulb table: %lld\n", b->rejected[2]);
+    }
+    if(b->cycles) {
+        printf("Cycles detected: %lld (%lld iterations saved)\n", 
+               b->cycles_found, b->cycles_saved);
+    }
+    printf("Mean count: %lld\n", b->mean);
+    printf("Max count: %lld\n", b->max);
+
+    long long ranges[20] = {0};
+    double twentieth = (double)b->max / 20;
+    long long n = 0;
+    size_t p = 0;
+    int i;
+    for(; p < b->plot_size; p++) {
+        long long c = buddha_count(b, p);
+        if(c != 0) {
+            int j = 1;
+            for(; j <= 20; j++) {
+                if(c < twentieth*j) {
+                    break;
+                }
+            }
+
+            n++;
+            ranges[j-1]++;
+        }
+    }
+
+    double pct_escaped = (double)n / b->max_offs * 100;
+    printf("Escaping points: %lld (%.2f%%)\n", n, pct_escaped);
+
+    printf("\nHistogram:\n");
+    float cum_pct = 0;
+    for(i = 0; i < 20; i++) {
+        long long low = twentieth*i;
+        long long hi = twentieth*(i+1);
+        long long c = ranges[i];
+        float pct = (float)c / n * 100;
+        cum_pct += pct;
+        printf("%2d %4lld   - %4lld %15lld  %3.2f  %3.2f\n", 
+               i+1, low, hi, c, pct, cum_pct);
+    }
+
+    printf("\nPercentile limits:\n");
+    for(i = 0; i < 10; i++) {
+        printf("%2d%%  %lld\n", (i+1)*10, b->percentile_limit[i]);
+    }
+    printf("\n");
+}
+
+
+/**
+ * Colors tiles t0 through t1 - 1 of the image. 
+ */
+void buddha_draw_tiles(buddha* b, int t0, int t1, int thread) {
+    int i, x, y;
+    for(i = t0; i < t1; i++) {
+        buddha_tile t;
+        buddha_get_tile(b, i, &t);
+        for(y = t.y0; y < t.y1; y++) {
+            for(x = t.x0; x < t.x1; x++) {
+                long long count = buddha_plot_at(b, x, y);
+                int c = getcolor(b, count);
+                putpixel(b, c, x, y);
+            }
+        }
+    }
+}
+
+
+/**
+ * Renders the final image. Used after the escaping values have been
+ * found and plotted. 
+ */
+void buddha_draw(buddha* b) {
+    buddha_parallel_tiles(b, "draw", &buddha_draw_tiles);
+}
+
+
+/**
+ * Counts how often each value appears in chunks c0 through c1 - 1 of the 
+ * plot, into the calling thread's frequency table. 
+ */
+void buddha_count_chunks(buddha* b, int c0, int c1, int thread) {
+    buddha_local* l = &b->locals[thread];
+    size_t i, hi = (size_t)c1 * PLOT_CHUNK < b->plot_size ? 
+        (size_t)c1 * PLOT_CHUNK : b->plot_size;
+    for(i = (size_t)c0 * PLOT_CHUNK; i < hi; i++) {
+        long long c = buddha_count(b, i);
+        if(c) {
+            l->frequency[c >> b->frequency_shift]++;
+            l->nonzero++;
+            l->sum += c;
+        }
+    }
+}
+
+
+/**
+ * Sums the threads' frequency tables for counts c0 through c1 - 1. 
+ */
+void buddha_merge_frequencies(buddha* b, int c0, int c1, int thread) {
+    int t, c;
+    for(t = 0; t < b->threads; t++) {
+        long long* f = b->locals[t].frequency;
+        for(c = c0; c < c1; c++) {
+            b->count_frequency[c] += f[c];
         }
     }
 }
@@ -363,31 +3850,54 @@ void buddha_draw(buddha* b) {
 
 /**
  * Walks through the plot, calculating the mean value and keeping track 
- * of how often each count appears. 
+ * of how often each count appears. Each thread counts into its own table, 
+ * and the tables are then summed. With counts too large for a table 
+ * with an entry for each, the percentiles are only as fine as the groups 
+ * of counts sharing an entry. 
  *
  * This allocates the count_frequency field. 
  */
 void buddha_compute_stats(buddha* b) {
-    int i = 0, sum = 0, n = 0;
-    b->count_frequency = (int*)malloc(sizeof(int) * b->max);
-    for(; i <= b->max_offs; i++) {
-        int c = b->plot[i];
-        if(c) {
-            b->count_frequency[c]++;
-            n++;
-            sum += c;
+    int i, t, size;
+    long long sum = 0, n = 0;
+    b->frequency_shift = 0;
+    while((b->max >> b->frequency_shift) >= FREQUENCY_MAX) {
+        b->frequency_shift++;
+    }
+    size = (int)(b->max >> b->frequency_shift) + 1;
+    b->count_frequency = (long long*)calloc(size, sizeof(long long));
+    if(b->count_frequency == NULL) {
+        err(5, "Could not allocate the count frequencies.");
+    }
+    for(t = 0; t < b->threads; t++) {
+        buddha_local* l = &b->locals[t];
+        l->frequency = (long long*)calloc(size, sizeof(long long));
+        if(l->frequency == NULL) {
+            err(5, "Could not allocate the count frequencies.");
         }
+        l->nonzero = 0;
+        l->sum = 0;
+    }
+    buddha_parallel_chunks(b, "stats", &buddha_count_chunks);
+    buddha_parallel(b, "merge", size, &buddha_merge_frequencies);
+    for(t = 0; t < b->threads; t++) {
+        buddha_local* l = &b->locals[t];
+        n += l->nonzero;
+        sum += l->sum;
+        free(l->frequency);
+        l->frequency = NULL;
     }
     b->mean = (double)sum / n;
     b->num_escaped = n;
 
     // Calculate the maximal count in for each tenth percentile.
     double d = (double)n / 10, lim = d;
-    int cum_freq = 0, p = 0;
-    for(i = 0; i < b->max; i++) {
+    long long cum_freq = 0;
+    int p = 0;
+    for(i = 0; i < size - 1; i++) {
         cum_freq += b->count_frequency[i];
         if(cum_freq > lim) {
-            b->percentile_limit[p++] = i;
+            b->percentile_limit[p++] = (long long)i << b->frequency_shift;
             lim += d;
         }
         if(p == 10) {
@@ -404,46 +3914,510 @@ void buddha_compute_stats(buddha* b) {
  * Computes and renders the buddhabrot image. 
  */
 void buddha_calculate(buddha* b) {
-    buddha_calc_escapes(b);
+    if(b->sampler != SAMPLER_GRID) {
+        buddha_init_sampling(b);
+    } else if(b->symmetric && !buddha_is_symmetric(b)) {
+        b->symmetric = 0;
+    }
+    buddha_alloc_locals(b);
+    buddha_size_orbits(b, b->iterations);
+    if(!b->single_pass && b->sampler == SAMPLER_GRID) {
+        buddha_calc_escapes(b);
+    }
     buddha_plot_escapes(b);
     buddha_compute_stats(b);
+    buddha_free_locals(b);
     buddha_draw(b);
 }
 
 
 /**
- * Saves a raw raster image as a TIFF. 
+ * Deflates strips s0 through s1 - 1 of the image for the TIFF. 
+ */
+void buddha_encode_strips(buddha* b, int s0, int s1, int thread) {
+    int s;
+    for(s = s0; s < s1; s++) {
+        int y0 = s * TIFF_STRIP_ROWS, y1 = y0 + TIFF_STRIP_ROWS;
+        if(y1 > b->height) {
+            y1 = b->height;
+        }
+        uLong len = (uLong)(y1 - y0) * b->width * 3;
+        uLongf size = compressBound(len);
+        b->strips[s] = (unsigned char*)malloc(size);
+        if(b->strips[s] == NULL) {
+            err(5, "Could not allocate the TIFF strips.");
+        }
+        if(compress2(b->strips[s], &size, 
+                     (const Bytef*)b->im + (size_t)y0 * b->width * 3, len, 
+                     Z_DEFAULT_COMPRESSION) != Z_OK) {
+            err(3, "Error compressing TIFF.");
+        }
+        b->strip_sizes[s] = size;
+    }
+}
+
+
+/**
+ * Saves the raster image as a TIFF. Its strips are compressed on the 
+ * thread pool and then written out in order, to a BigTIFF if they are 
+ * too large for a classic one. 
  */
-void write_tiff(char* raster) {
-    TIFF* im = TIFFOpen("buddhabrot.tiff", "w");
+void write_tiff(buddha* b, const char* path) {
+    int s, num_strips = (b->height + TIFF_STRIP_ROWS - 1) / TIFF_STRIP_ROWS;
+    unsigned long long total = 0;
+    b->strips = (unsigned char**)calloc(num_strips, sizeof(unsigned char*));
+    b->strip_sizes = (unsigned long*)calloc(num_strips, sizeof(unsigned long));
+    if(b->strips == NULL || b->strip_sizes == NULL) {
+        err(5, "Could not allocate the TIFF strips.");
+    }
+    buddha_parallel(b, "encode", num_strips, &buddha_encode_strips);
+    for(s = 0; s < num_strips; s++) {
+        total += b->strip_sizes[s];
+    }
+
+    TIFF* im = TIFFOpen(path, total > TIFF_BIG_SIZE ? "w8" : "w");
     if(im == NULL) {
         err(2, "Could not open output TIFF.");
     }
     
-    TIFFSetField(im, TIFFTAG_IMAGEWIDTH, WIDTH);
-    TIFFSetField(im, TIFFTAG_IMAGELENGTH, HEIGHT);
+    TIFFSetField(im, TIFFTAG_IMAGEWIDTH, b->width);
+    TIFFSetField(im, TIFFTAG_IMAGELENGTH, b->height);
+    TIFFSetField(im, TIFFTAG_ROWSPERSTRIP, TIFF_STRIP_ROWS);
     TIFFSetField(im, TIFFTAG_COMPRESSION, COMPRESSION_DEFLATE);
     TIFFSetField(im, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
     TIFFSetField(im, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
     TIFFSetField(im, TIFFTAG_BITSPERSAMPLE, 8);
     TIFFSetField(im, TIFFTAG_SAMPLESPERPIXEL, 3);
 
-    if(TIFFWriteEncodedStrip(im, 0, raster, WIDTH*HEIGHT*3) == 0) {
-        err(3, "Error writing TIFF.");
+    for(s = 0; s < num_strips; s++) {
+        if(TIFFWriteRawStrip(im, s, b->strips[s], b->strip_sizes[s]) < 0) {
+            err(3, "Error writing TIFF.");
+        }
+        free(b->strips[s]);
     }
 
     TIFFClose(im);
+    free(b->strips);
+    free(b->strip_sizes);
+    b->strips = NULL;
+    b->strip_sizes = NULL;
+}
+
+
+/**
+ * Parses an integer option value, which must be at least min. 
+ */
+int parse_int(const char* value, int min, int* out) {
+    char* end;
+    long v = strtol(value, &end, 10);
+    if(*value == '\0' || *end != '\0' || v < min || v > 0x7fffffff) {
+        return 0;
+    }
+    *out = (int)v;
+    return 1;
+}
+
+
+int parse_double(const char* value, double min, double* out) {
+    char* end;
+    double v = strtod(value, &end);
+    if(*value == '\0' || *end != '\0' || v < min) {
+        return 0;
+    }
+    *out = v;
+    return 1;
+}
+
+
+int parse_bool(const char* value, int* out) {
+    if(!strcmp(value, "1") || !strcmp(value, "yes") || 
+       !strcmp(value, "true") || !strcmp(value, "on")) {
+        *out = 1;
+        return 1;
+    }
+    if(!strcmp(value, "0") || !strcmp(value, "no") || 
+       !strcmp(value, "false") || !strcmp(value, "off")) {
+        *out = 0;
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Sets an option by name. The names are the same on the command line 
+ * (as --name value) and in config files (as name = value). Flags take 
+ * 1 or 0, yes or no, true or false, or on or off. Returns 0 if the name 
+ * isn't known or the value isn't valid for it. 
+ */
+int buddha_set_option(buddha_options* o, const char* name, 
+                      const char* value) {
+    int scale;
+    if(!strcmp(name, "width")) {
+        return parse_int(value, 1, &o->width);
+    }
+    if(!strcmp(name, "height")) {
+        return parse_int(value, 1, &o->height);
+    }
+    if(!strcmp(name, "scale")) {
+        // The same 16:10 frame as the default, in multiples of 1440x900. 
+        if(!parse_int(value, 1, &scale)) {
+            return 0;
+        }
+        o->width = 1440 * scale;
+        o->height = 900 * scale;
+        return 1;
+    }
+    if(!strcmp(name, "iterations")) {
+        return parse_int(value, 1, &o->iterations);
+    }
+    if(!strcmp(name, "output")) {
+        o->output = strdup(value);
+        return 1;
+    }
+    if(!strcmp(name, "threads")) {
+        return parse_int(value, 1, &o->threads);
+    }
+    if(!strcmp(name, "timeline")) {
+        return parse_bool(value, &o->timeline);
+    }
+    if(!strcmp(name, "pin")) {
+        int i;
+        for(i = 0; pin_names[i]; i++) {
+            if(!strcmp(value, pin_names[i])) {
+                o->pin = i;
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if(!strcmp(name, "single-pass")) {
+        return parse_bool(value, &o->single_pass);
+    }
+    if(!strcmp(name, "bins")) {
+        return parse_bool(value, &o->binned);
+    }
+    if(!strcmp(name, "hot-bins")) {
+        return parse_int(value, 0, &o->hot_bins);
+    }
+    if(!strcmp(name, "wide-counters")) {
+        return parse_bool(value, &o->wide);
+    }
+    if(!strcmp(name, "compact")) {
+        return parse_bool(value, &o->compact);
+    }
+    if(!strcmp(name, "layout")) {
+        int i;
+        for(i = 0; layout_names[i]; i++) {
+            if(!strcmp(value, layout_names[i])) {
+                o->layout = i;
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if(!strcmp(name, "subdivide")) {
+        return parse_bool(value, &o->subdivide);
+    }
+    if(!strcmp(name, "verify-fill")) {
+        return parse_bool(value, &o->verify_fill);
+    }
+    if(!strcmp(name, "escape-map")) {
+        if(!strcmp(value, "auto")) {
+            o->escape_width = 0;
+        } else if(!strcmp(value, "16")) {
+            o->escape_width = ESCAPE_16;
+        } else if(!strcmp(value, "32")) {
+            o->escape_width = ESCAPE_32;
+        } else if(!strcmp(value, "bits")) {
+            o->escape_width = ESCAPE_BITS;
+        } else {
+            return 0;
+        }
+        return 1;
+    }
+    if(!strcmp(name, "min-orbit")) {
+        return parse_int(value, 1, &o->min_orbit);
+    }
+    if(!strcmp(name, "max-orbit")) {
+        return parse_int(value, 1, &o->max_orbit);
+    }
+    if(!strcmp(name, "orbit-limit")) {
+        return parse_int(value, 1, &o->orbit_limit);
+    }
+    if(!strcmp(name, "kernel")) {
+        o->kernel = strdup(value);
+        return 1;
+    }
+    if(!strcmp(name, "reject")) {
+        return parse_bool(value, &o->reject);
+    }
+    if(!strcmp(name, "bulb-table")) {
+        return parse_bool(value, &o->bulb_table);
+    }
+    if(!strcmp(name, "cycles")) {
+        return parse_bool(value, &o->cycles);
+    }
+    if(!strcmp(name, "cycle-tolerance")) {
+        return parse_double(value, 0, &o->cycle_tolerance) && 
+            o->cycle_tolerance <= CYCLE_TOLERANCE_MAX;
+    }
+    if(!strcmp(name, "symmetry")) {
+        return parse_bool(value, &o->symmetric);
+    }
+    if(!strcmp(name, "center")) {
+        char* end;
+        o->center_re = strtod(value, &end);
+        if(end == value || *end != ',') {
+            return 0;
+        }
+        return parse_double(end + 1, -INFINITY, &o->center_im);
+    }
+    if(!strcmp(name, "sampler")) {
+        int i;
+        for(i = 0; sampler_names[i]; i++) {
+            if(!strcmp(value, sampler_names[i])) {
+                o->sampler = i;
+                return 1;
+            }
+        }
+        return 0;
+    }
+    if(!strcmp(name, "band-boost")) {
+        return parse_int(value, 1, &o->band_boost);
+    }
+    if(!strcmp(name, "band-dilate")) {
+        return parse_int(value, 0, &o->band_dilate);
+    }
+    if(!strcmp(name, "rotate")) {
+        return parse_bool(value, &o->rotate);
+    }
+    if(!strcmp(name, "samples")) {
+        char* end;
+        o->samples = strtoll(value, &end, 10);
+        return *value != '\0' && *end == '\0' && o->samples > 0;
+    }
+    if(!strcmp(name, "spp")) {
+        o->samples = 0;
+        return parse_double(value, DBL_MIN, &o->spp);
+    }
+    if(!strcmp(name, "region")) {
+        double* v = o->region;
+        char c;
+        return sscanf(value, "%lf,%lf,%lf,%lf%c", 
+                      &v[0], &v[1], &v[2], &v[3], &c) == 4 && 
+            v[0] < v[2] && v[1] < v[3];
+    }
+    if(!strcmp(name, "seed")) {
+        char* end;
+        o->seed = strtoull(value, &end, 10);
+        return *value != '\0' && *end == '\0';
+    }
+    if(!strcmp(name, "span")) {
+        return parse_double(value, DBL_MIN, &o->span);
+    }
+    if(!strcmp(name, "aspect")) {
+        return parse_double(value, DBL_MIN, &o->aspect);
+    }
+    return 0;
+}
+
+
+/**
+ * Reads options from a config file. Each line is an option name and its 
+ * value, separated by '=' or whitespace. Blank lines and anything after 
+ * a '#' are ignored. 
+ */
+void buddha_read_config(buddha_options* o, const char* path) {
+    char line[1024];
+    int n = 0;
+    FILE* f = fopen(path, "r");
+    if(f == NULL) {
+        fprintf(stderr, "Could not open config file %s\n", path);
+        exit(1);
+    }
+
+    while(fgets(line, sizeof(line), f)) {
+        n++;
+        char* p = strchr(line, '#');
+        if(p) {
+            *p = '\0';
+        }
+
+        char* name = strtok(line, " \t\r\n=");
+        char* value = strtok(NULL, " \t\r\n=");
+        if(name == NULL) {
+            continue;
+        }
+        if(value == NULL || strtok(NULL, " \t\r\n") != NULL || 
+           !buddha_set_option(o, name, value)) {
+            fprintf(stderr, "%s:%d: bad option\n", path, n);
+            exit(1);
+        }
+    }
+    fclose(f);
+}
+
+
+/**
+ * The command line options. Each is handled by buddha_set_option under 
+ * the same name; a "no-" prefix sets the flag without it to 0. The 
+ * exceptions are config, which reads a file of options, and help. 
+ */
+const struct option buddha_long_options[] = {
+    { "help",            no_argument,       NULL, 'h' },
+    { "config",          required_argument, NULL, 'f' },
+    { "width",           required_argument, NULL, 'W' },
+    { "height",          required_argument, NULL, 'H' },
+    { "scale",           required_argument, NULL, 0 },
+    { "iterations",      required_argument, NULL, 'i' },
+    { "output",          required_argument, NULL, 'o' },
+    { "threads",         required_argument, NULL, 't' },
+    { "timeline",        no_argument,       NULL, 'T' },
+    { "pin",             required_argument, NULL, 0 },
+    { "single-pass",     no_argument,       NULL, 's' },
+    { "bins",            no_argument,       NULL, 0 },
+    { "hot-bins",        required_argument, NULL, 0 },
+    { "wide-counters",   no_argument,       NULL, 0 },
+    { "compact",         no_argument,       NULL, 0 },
+    { "layout",          required_argument, NULL, 0 },
+    { "subdivide",       no_argument,       NULL, 'm' },
+    { "verify-fill",     no_argument,       NULL, 0 },
+    { "escape-map",      required_argument, NULL, 0 },
+    { "min-orbit",       required_argument, NULL, 0 },
+    { "max-orbit",       required_argument, NULL, 0 },
+    { "orbit-limit",     required_argument, NULL, 'b' },
+    { "kernel",          required_argument, NULL, 'k' },
+    { "no-reject",       no_argument,       NULL, 'x' },
+    { "bulb-table",      no_argument,       NULL, 'd' },
+    { "cycle-tolerance", required_argument, NULL, 'c' },
+    { "no-cycles",       no_argument,       NULL, 'C' },
+    { "no-symmetry",     no_argument,       NULL, 'S' },
+    { "center",          required_argument, NULL, 0 },
+    { "span",            required_argument, NULL, 0 },
+    { "aspect",          required_argument, NULL, 0 },
+    { "sampler",         required_argument, NULL, 0 },
+    { "samples",         required_argument, NULL, 'n' },
+    { "spp",             required_argument, NULL, 0 },
+    { "region",          required_argument, NULL, 0 },
+    { "seed",            required_argument, NULL, 0 },
+    { "rotate",          no_argument,       NULL, 0 },
+    { "band-boost",      required_argument, NULL, 0 },
+    { "band-dilate",     required_argument, NULL, 0 },
+    { NULL, 0, NULL, 0 }
+};
+
+
+void usage() {
+    fprintf(stderr, 
+"usage: buddhabrot [options]\n"
+"\n"
+"  -h, --help                 show this message\n"
+"  -f, --config FILE          read options from FILE (name = value)\n"
+"  -W, --width N              image width in pixels (default 5760)\n"
+"  -H, --height N             image height in pixels (default 3600)\n"
+"      --scale N              image size of 1440N x 900N pixels\n"
+"  -i, --iterations N         iteration limit (default 40000)\n"
+"  -o, --output FILE          output TIFF (default buddhabrot.tiff)\n"
+"  -t, --threads N            worker threads (default: one per CPU)\n"
+"  -T, --timeline             show how busy each thread was in each pass\n"
+"      --pin HOW              pin threads to CPUs: none, compact or spread\n"
+"  -s, --single-pass          iterate each point once, keeping its orbit\n"
+"      --bins                 plot orbit points a histogram bin at a time\n"
+"      --hot-bins N           keep private copies of just the N busiest\n"
+"                             bins of the histogram, not all of it\n"
+"      --wide-counters        64-bit histogram counters, for counts past\n"
+"                             2^31 on long runs\n"
+"      --compact              16-bit histogram counters, spilling over\n"
+"      --layout HOW           histogram in rows, tiled or morton order\n"
+"  -m, --subdivide            fill solid parts of the set without iterating\n"
+"      --verify-fill          iterate the filled pixels anyway, to check\n"
+"      --escape-map TYPE      escape times in 16 or 32 bits, or just bits\n"
+"                             (default: 16 if the iterations fit)\n"
+"      --min-orbit N          plot only points escaping at iteration N or\n"
+"      --max-orbit N          later, or at N or before\n"
+"  -b, --orbit-limit N        longest orbit buffered by each kernel lane in\n"
+"                             the plot pass; longer ones are iterated\n"
+"                             again (default 65536)\n"
+"  -k, --kernel NAME          avx512, avx2 or scalar (default: best)\n"
+"  -x, --no-reject            iterate points in the cardioid and bulb\n"
+"  -d, --bulb-table           also skip points in smaller bulbs\n"
+"  -c, --cycle-tolerance D    lossy: also count orbits coming within D\n"
+"                             (up to 1e-6) of a repeat as cyclic, which\n"
+"                             can drop points that escape (default 0)\n"
+"  -C, --no-cycles            don't look for cyclic orbits\n"
+"  -S, --no-symmetry          iterate both halves of a symmetric image\n"
+"      --center RE,IM         center of the view (default -0.5,0)\n"
+"      --span D               width of the view on the real axis (3)\n"
+"      --aspect D             height of the view over its width (2/3)\n"
+"      --sampler NAME         grid (one point per pixel), random, jitter,\n"
+"                             metropolis (for zoomed views), sobol, r2\n"
+"                             or band (denser near the boundary)\n"
+"  -n, --samples N            points to sample with any sampler but grid\n"
+"      --spp D                points to sample per pixel of the image (1)\n"
+"      --region R0,I0,R1,I1   region to sample (default -2,-2,2,2)\n"
+"      --seed N               seed for the random samplers\n"
+"      --rotate               randomly shift the sobol and r2 sequences\n"
+"      --band-boost N         how many times denser the band is sampled (8)\n"
+"      --band-dilate N        cells the band is widened by on each side (2)\n");
+    exit(1);
 }
 
 
-int main() {
+int main(int argc, char** argv) {
+    buddha_options o;
+    buddha_options_init(&o);
+
+    int opt, index;
+    while((opt = getopt_long(argc, argv, "hf:W:H:i:o:t:Tsmb:k:xdc:CSn:", 
+                             buddha_long_options, &index)) != -1) {
+        if(opt == '?' || opt == 'h') {
+            usage();
+        }
+        if(opt != 0) {
+            for(index = 0; buddha_long_options[index].val != opt; index++);
+        }
+
+        const char* name = buddha_long_options[index].name;
+        const char* value = optarg ? optarg : "1";
+        if(!strncmp(name, "no-", 3)) {
+            name += 3;
+            value = "0";
+        }
+
+        if(!strcmp(name, "config")) {
+            buddha_read_config(&o, value);
+        } else if(!buddha_set_option(&o, name, value)) {
+            fprintf(stderr, "Bad value for --%s: %s\n", name, value);
+            usage();
+        }
+    }
+    if(optind < argc) {
+        usage();
+    }
+
     buddha b;
-    buddha_init(&b, WIDTH, HEIGHT, ITERATIONS, 0);
+    buddha_init(&b, &o);
+    if(!buddha_set_kernel(&b, o.kernel)) {
+        err(1, "That kernel isn't supported on this CPU.");
+    }
+    if(b.escape_width == ESCAPE_16 && b.iterations - 1 > ESCAPE_16_MAX) {
+        err(1, "Too many iterations for a 16-bit escape map.");
+    }
+    if(b.escape_width == ESCAPE_BITS && b.subdivide) {
+        err(1, "Subdivision doesn't work with a 1-bit escape map.");
+    }
+    if(b.compact && b.hot_bins > 0) {
+        err(1, "A compact histogram can't have hot bins.");
+    }
+    if(b.compact && b.wide) {
+        err(1, "A compact histogram can't have wide counters.");
+    }
 
     buddha_calculate(&b);
     buddha_print_stats(&b);
     
-    write_tiff(b.im);
+    write_tiff(&b, o.output);
     buddha_free(&b);
     return 0;
 }